@@ -3,6 +3,10 @@
 #include <assert.h>
 #include <string.h>
 #include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include "stats.h"
+#include "fileio.h"
 
 typedef struct item
 {
@@ -24,11 +28,21 @@ typedef struct ans
     unsigned char *flags;
 } Answer;
 
+// Greedy prefix table over the items in decreasing ratio order, built once
+// and then queried for any number of capacities.
+typedef struct prefix
+{
+    int number;
+    double *weight; // weight[k], value[k]: totals of the k items with the best ratio
+    double *value;
+    double *ratio;  // ratio[k]: ratio of the (k+1)-th best item
+} Prefix;
+
 Itemset *init_itemset(int number, int seed);
 void free_itemset(Itemset *list);
 Itemset *load_itemset(char *filename);
 void print_itemset(Itemset *list);
-void save_itemset(char *filename);
+void save_itemset(const Itemset *list, const char *filename);
 
 Answer solve(Itemset *list, double capacity);
 Answer greedy_search(int index, Itemset *list, double capacity, unsigned char *flags, double sum_v, double sum_w);
@@ -39,6 +53,72 @@ double load_double(const char *argvalue);
 void quick_sort(Itemset *list, int low, int high);
 void swap(Item *i, Item *j);
 
+Prefix *build_prefix(Itemset *list);
+void free_prefix(Prefix *prefix);
+int query_prefix(const Prefix *prefix, double capacity, double *bound);
+void run_queries(const Prefix *prefix, FILE *fp);
+
+// Sequential passes over a binary item file.
+typedef struct stream
+{
+    BlockReader *reader;
+    const ItemRecord *block; // items of the last read_block
+    long long number;
+} ItemStream;
+
+typedef struct streamed
+{
+    double value;
+    double weight;
+    long long taken;
+    int passes;
+} Streamed;
+
+ItemStream *open_stream(const char *filename);
+void rewind_stream(ItemStream *stream);
+size_t read_block(ItemStream *stream);
+void close_stream(ItemStream *stream);
+Streamed stream_greedy(ItemStream *stream, double capacity);
+
+// Result of the exact core solver.
+typedef struct exact
+{
+    double value;
+    double weight;
+    int taken;
+    int core;       // size of the core that proved optimality
+    int expansions;
+    int proven;     // 0 if the search gave up at STATE_LIMIT states
+} Exact;
+
+int find_break(Item *item, int n, double capacity);
+void select_ratio(Item *item, int low, int high, int k);
+Exact core_search(Itemset *list, double capacity, unsigned char *flags);
+
+enum { PHASE_CONSTRUCT, PHASE_SORT, PHASE_SELECT, PHASE_QUERY, PHASE_STREAM, PHASE_OUTPUT, N_PHASE };
+enum { COUNT_SORT_CALLS, COUNT_SORT_SWAPS, COUNT_SELECTED, COUNT_REJECTED, COUNT_QUERIES, COUNT_PASSES, COUNT_BYTES,
+       COUNT_CORE_NODES, COUNT_EXPANSIONS, N_COUNTER };
+
+StatsPhase phase[N_PHASE] = {
+    [PHASE_CONSTRUCT] = {"construct"},
+    [PHASE_SORT] = {"sort"},
+    [PHASE_SELECT] = {"select"},
+    [PHASE_QUERY] = {"query"},
+    [PHASE_STREAM] = {"stream"},
+    [PHASE_OUTPUT] = {"output"},
+};
+StatsCounter counter[N_COUNTER] = {
+    [COUNT_SORT_CALLS] = {"sort_calls"},
+    [COUNT_SORT_SWAPS] = {"sort_swaps"},
+    [COUNT_SELECTED] = {"selected"},
+    [COUNT_REJECTED] = {"rejected"},
+    [COUNT_QUERIES] = {"queries"},
+    [COUNT_PASSES] = {"passes"},
+    [COUNT_BYTES] = {"bytes_read"},
+    [COUNT_CORE_NODES] = {"core_nodes"},
+    [COUNT_EXPANSIONS] = {"core_expansions"},
+};
+
 int load_int(const char *argvalue)
 {
     long nl;
@@ -79,28 +159,138 @@ double load_double(const char *argvalue)
 
 int main(int argc, char **argv)
 {
-    if (argc != 3)
+    char *args[argc];
+    int nargs = 0;
+    int seed = 1;
+    const char *save_file = NULL;
+    int show_stats = 0;
+    int query = 0;
+    const char *stream_file = NULL;
+    int exact = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--seed=", 7) == 0)
+            seed = load_int(argv[i] + 7);
+        else if (strncmp(argv[i], "--save=", 7) == 0)
+            save_file = argv[i] + 7;
+        else if (strcmp(argv[i], "--stats=json") == 0)
+            show_stats = 1;
+        else if (strcmp(argv[i], "--query") == 0)
+            query = 1;
+        else if (strncmp(argv[i], "--stream=", 9) == 0)
+            stream_file = argv[i] + 9;
+        else if (strcmp(argv[i], "--exact") == 0)
+            exact = 1;
+        else if (strncmp(argv[i], "--", 2) == 0)
+        {
+            fprintf(stderr, "%s: unknown option.\n", argv[i]);
+            exit(1);
+        }
+        else
+            args[nargs++] = argv[i];
+    }
+    if (stream_file != NULL)
+    {
+        if (nargs != 1 || query)
+        {
+            fprintf(stderr, "usage: %s --stream=<item file> [--stats=json] <max capacity (double)>\n", argv[0]);
+            exit(1);
+        }
+        const double W = load_double(args[0]);
+        assert(W >= 0.0);
+
+        ItemStream *stream = open_stream(stream_file);
+        printf("max capacity: W = %.f, # of items: %lld\n", W, stream->number);
+        Streamed a = stream_greedy(stream, W);
+        close_stream(stream);
+
+        printf("----\nbest solution:\n");
+        printf("value: %4.1f\n", a.value);
+        printf("weight: %4.1f, items: %lld, passes: %d\n", a.weight, a.taken, a.passes);
+        if (show_stats)
+            stats_print_json(stderr, "advance", phase, N_PHASE, counter, N_COUNTER);
+        return 0;
+    }
+
+    if (nargs != (query ? 1 : 2))
     {
-        fprintf(stderr, "usage: %s <the number of items (int)> <max capacity (double)>\n", argv[0]);
+        fprintf(stderr, "usage: %s [--seed=N] [--save=<item file>] [--stats=json] <the number of items (int)> <max capacity (double)>\n"
+                        "       %s --query [--seed=N] [--stats=json] <the number of items (int)> < capacities\n"
+                        "       %s --stream=<item file> [--stats=json] <max capacity (double)>\n"
+                        "       %s --exact [--seed=N] [--stats=json] <the number of items (int)> <max capacity (double)>\n",
+                argv[0], argv[0], argv[0], argv[0]);
         exit(1);
     }
 
     const int max_items = 1.0E8;
 
-    const int n = load_int(argv[1]);
+    const int n = load_int(args[0]);
     assert(n <= max_items);
 
-    const double W = load_double(argv[2]);
+    if (query)
+    {
+        STATS_TIMER_BEGIN(t_construct);
+        Itemset *items = init_itemset(n, seed);
+        STATS_TIMER_END(t_construct, phase[PHASE_CONSTRUCT]);
+        if (save_file != NULL)
+            save_itemset(items, save_file);
+
+        Prefix *prefix = build_prefix(items);
+        run_queries(prefix, stdin);
+
+        if (show_stats)
+            stats_print_json(stderr, "advance", phase, N_PHASE, counter, N_COUNTER);
+        free_prefix(prefix);
+        free_itemset(items);
+        return 0;
+    }
+
+    const double W = load_double(args[1]);
     assert(W >= 0.0);
 
     printf("max capacity: W = %.f, # of items: %d\n", W, n);
 
-    int seed = 1;
+    if (exact)
+    {
+        STATS_TIMER_BEGIN(t_construct);
+        Itemset *items = init_itemset(n, seed);
+        STATS_TIMER_END(t_construct, phase[PHASE_CONSTRUCT]);
+        if (save_file != NULL)
+            save_itemset(items, save_file);
+
+        unsigned char *flags = (unsigned char *)calloc(n > 0 ? n : 1, sizeof(unsigned char));
+        Exact a = core_search(items, W, flags);
+
+        STATS_TIMER_BEGIN(t_output);
+        printf("----\nbest solution:\n");
+        printf("value: %4.1f\n", a.value);
+        printf("weight: %4.1f, items: %d, core: %d, expansions: %d, proven: %s\n", a.weight, a.taken, a.core,
+               a.expansions, a.proven ? "yes" : "no");
+        for (int i = 0; i < n; i++)
+            printf("%d", flags[i]);
+        printf("\n");
+        fflush(stdout);
+        STATS_TIMER_END(t_output, phase[PHASE_OUTPUT]);
+
+        if (show_stats)
+            stats_print_json(stderr, "advance", phase, N_PHASE, counter, N_COUNTER);
+        free(flags);
+        free_itemset(items);
+        return 0;
+    }
+
+    STATS_TIMER_BEGIN(t_construct);
     Itemset *items = init_itemset(n, seed);
+    STATS_TIMER_END(t_construct, phase[PHASE_CONSTRUCT]);
+    STATS_TIMER_BEGIN(t_header);
+    if (save_file != NULL)
+        save_itemset(items, save_file);
     print_itemset(items);
+    STATS_TIMER_END(t_header, phase[PHASE_OUTPUT]);
 
     Answer a = solve(items, W);
 
+    STATS_TIMER_BEGIN(t_output);
     printf("----\nbest solution:\n");
     printf("value: %4.1f\n", a.value);
     for (int i = 0; i < items->number; i++)
@@ -108,6 +298,11 @@ int main(int argc, char **argv)
         printf("%d", a.flags[i]);
     }
     printf("\n");
+    fflush(stdout);
+    STATS_TIMER_END(t_output, phase[PHASE_OUTPUT]);
+
+    if (show_stats)
+        stats_print_json(stderr, "advance", phase, N_PHASE, counter, N_COUNTER);
     free(a.flags);
     a.flags = NULL;
 
@@ -139,6 +334,19 @@ void free_itemset(Itemset *list)
     free(list);
 }
 
+// Writes the item set in the binary format read by knapsack1's load_itemset().
+void save_itemset(const Itemset *list, const char *filename)
+{
+    BlockWriter *w = open_writer(filename);
+    write_count(w, list->number);
+    for (int i = 0; i < list->number; i++)
+    {
+        const ItemRecord record = {.value = list->item[i].value, .weight = list->item[i].weight};
+        write_bytes(w, &record, sizeof(record));
+    }
+    close_writer(w);
+}
+
 void print_itemset(Itemset *list)
 {
     int n = list->number;
@@ -163,24 +371,36 @@ Answer greedy_search(int index, Itemset *list, double capacity, unsigned char *f
         choosed[i] = 0;
         flags[i] = 0;
     }
+    STATS_TIMER_BEGIN(t_sort);
     quick_sort(list, 0, list->number - 1);
+    STATS_TIMER_END(t_sort, phase[PHASE_SORT]);
+
+    STATS_TIMER_BEGIN(t_print);
     print_itemset(list);
+    STATS_TIMER_END(t_print, phase[PHASE_OUTPUT]);
+
+    STATS_TIMER_BEGIN(t_select);
     for (int i = list->number-1; i>=0; --i)
     {
         if (list->item[i].weight <= capacity)
         {
+            STATS_INC(counter[COUNT_SELECTED]);
             choosed[i] = list->item[i].label;
             capacity -= list->item[i].weight;
             sum_w += list->item[i].weight;
             sum_v += list->item[i].value;
         }
         else
+        {
+            STATS_INC(counter[COUNT_REJECTED]);
             continue;
+        }
     }
 
     for (int i=0; i<list->number; ++i)
         if (choosed[i] != 0)
             flags[choosed[i]-1] = 1;
+    STATS_TIMER_END(t_select, phase[PHASE_SELECT]);
 
     return (Answer){.flags = flags, .value = sum_v};
 }
@@ -189,6 +409,7 @@ void swap(Item *i, Item *j)
 {
     Item trans;
 
+    STATS_INC(counter[COUNT_SORT_SWAPS]);
     trans = *i;
     *i = *j;
     *j = trans;
@@ -196,11 +417,12 @@ void swap(Item *i, Item *j)
 
 void quick_sort(Itemset *itemset, int low, int high)
 {
-    Item pivot = itemset->item[low];
     int i = low, j = high;
 
+    STATS_INC(counter[COUNT_SORT_CALLS]);
     if (low >= high)
         return;
+    Item pivot = itemset->item[low];
     while (low < high)
     {
         while (low < high && pivot.ratio <= itemset->item[high].ratio)
@@ -220,4 +442,729 @@ void quick_sort(Itemset *itemset, int low, int high)
     }
     quick_sort(itemset, i, low-1);
     quick_sort(itemset, low+1, j);
-}
\ No newline at end of file
+}
+
+static int compare_label_desc(const void *p, const void *q)
+{
+    const int a = ((const Item *)p)->label;
+    const int b = ((const Item *)q)->label;
+    return (a < b) - (a > b);
+}
+
+// Sorts the items and tabulates the greedy prefix sums. Items of equal ratio
+// are taken in input order, so the prefix does not depend on how quick_sort
+// happened to leave them.
+Prefix *build_prefix(Itemset *list)
+{
+    const int n = list->number;
+    Prefix *prefix = (Prefix *)malloc(sizeof(Prefix));
+    prefix->number = n;
+    prefix->weight = (double *)malloc(sizeof(double) * (n + 1));
+    prefix->value = (double *)malloc(sizeof(double) * (n + 1));
+    prefix->ratio = (double *)malloc(sizeof(double) * (n + 1));
+
+    STATS_TIMER_BEGIN(t_sort);
+    quick_sort(list, 0, n - 1);
+    for (int s = 0, e; s < n; s = e)
+    {
+        for (e = s + 1; e < n && list->item[e].ratio == list->item[s].ratio; e++)
+            ;
+        if (e - s > 1)
+            qsort(list->item + s, e - s, sizeof(Item), compare_label_desc);
+    }
+    STATS_TIMER_END(t_sort, phase[PHASE_SORT]);
+
+    // quick_sort leaves the best ratio last
+    STATS_TIMER_BEGIN(t_select);
+    prefix->weight[0] = 0.0;
+    prefix->value[0] = 0.0;
+    for (int k = 0; k < n; k++)
+    {
+        const Item *item = &list->item[n - 1 - k];
+        prefix->weight[k + 1] = prefix->weight[k] + item->weight;
+        prefix->value[k + 1] = prefix->value[k] + item->value;
+        prefix->ratio[k] = item->ratio;
+    }
+    prefix->ratio[n] = 0.0;
+    STATS_TIMER_END(t_select, phase[PHASE_SELECT]);
+    return prefix;
+}
+
+void free_prefix(Prefix *prefix)
+{
+    free(prefix->weight);
+    free(prefix->value);
+    free(prefix->ratio);
+    free(prefix);
+}
+
+// Number of best-ratio items that fit into capacity, found by binary search.
+// bound receives the LP relaxation bound, which tops the prefix up with a
+// fraction of the first item that does not fit.
+int query_prefix(const Prefix *prefix, double capacity, double *bound)
+{
+    int lo = 0, hi = prefix->number;
+    while (lo < hi)
+    {
+        const int mid = (lo + hi + 1) / 2;
+        if (prefix->weight[mid] <= capacity)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    *bound = prefix->value[lo] + (capacity - prefix->weight[lo]) * prefix->ratio[lo];
+    return lo;
+}
+
+// Answers one capacity per input line with
+// "capacity<TAB>value<TAB>weight<TAB>items<TAB>upper bound".
+// The answer is the greedy prefix, which stops at the first item that does
+// not fit instead of scanning on for smaller ones.
+void run_queries(const Prefix *prefix, FILE *fp)
+{
+    char line[256];
+    STATS_TIMER_BEGIN(t_query);
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0')
+            continue;
+        const double capacity = load_double(line);
+        assert(capacity >= 0.0);
+
+        double bound;
+        const int k = query_prefix(prefix, capacity, &bound);
+        STATS_INC(counter[COUNT_QUERIES]);
+        printf("%s\t%.1f\t%.1f\t%d\t%.3f\n", line, prefix->value[k], prefix->weight[k], k, bound);
+    }
+    fflush(stdout);
+    STATS_TIMER_END(t_query, phase[PHASE_QUERY]);
+}
+
+ItemStream *open_stream(const char *filename)
+{
+    ItemStream *stream = (ItemStream *)malloc(sizeof(ItemStream));
+    stream->reader = open_reader(filename);
+    stream->block = NULL;
+    rewind_stream(stream);
+    return stream;
+}
+
+void rewind_stream(ItemStream *stream)
+{
+    rewind_reader(stream->reader);
+    if ((stream->number = read_count(stream->reader)) < 0)
+    {
+        fprintf(stderr, "%s: invalid item file.\n", stream->reader->filename);
+        exit(1);
+    }
+}
+
+// Points stream->block at the next buffered items and returns how many there
+// are, 0 at the end of the file.
+size_t read_block(ItemStream *stream)
+{
+    size_t got;
+    stream->block = (const ItemRecord *)next_records(stream->reader, sizeof(ItemRecord), &got);
+    STATS_ADD(counter[COUNT_BYTES], got * sizeof(ItemRecord));
+    return got;
+}
+
+void close_stream(ItemStream *stream)
+{
+    close_reader(stream->reader);
+    free(stream);
+}
+
+// Order-preserving integer key of a non-negative ratio: the IEEE bits
+// without the sign. Items of zero weight rank above everything else.
+static uint64_t ratio_key(double value, double weight)
+{
+    const double ratio = (weight > 0.0) ? value / weight : INFINITY;
+    uint64_t bits;
+    memcpy(&bits, &ratio, sizeof(bits));
+    return bits << 1;
+}
+
+#define HISTOGRAM_BITS 17
+#define HISTOGRAM_SIZE (1 << HISTOGRAM_BITS)
+#define CRITICAL_LIMIT (1 << 22) // items of the critical bucket held in memory
+
+// an item of the critical bucket and its place in the file
+typedef struct candidate
+{
+    double value;
+    double weight;
+    long long index;
+} Candidate;
+
+static int compare_candidate(const void *p, const void *q)
+{
+    const Candidate *a = (const Candidate *)p;
+    const Candidate *b = (const Candidate *)q;
+    const uint64_t ka = ratio_key(a->value, a->weight);
+    const uint64_t kb = ratio_key(b->value, b->weight);
+    if (ka != kb)
+        return (ka < kb) - (ka > kb);
+    return (a->index > b->index) - (a->index < b->index);
+}
+
+// The greedy prefix of --query over a file that need not fit in memory: items
+// in decreasing ratio order, equal ratios in file order, are taken until the
+// first one that does not fit. Each histogram pass buckets the ratios of the
+// items still undecided by the next HISTOGRAM_BITS bits of their key and finds
+// the critical bucket, the one in which the capacity runs out: buckets above
+// it are taken whole, and nothing below it is reached. Once the critical
+// bucket is small enough, a last pass loads it and the prefix is continued
+// through it in order. A bucket that holds a single ratio is already in order
+// in the file and is not loaded. The result does not depend on the number of
+// passes.
+Streamed stream_greedy(ItemStream *stream, double capacity)
+{
+    STATS_TIMER_BEGIN(t_stream);
+    Streamed ans = {.value = 0.0, .weight = 0.0, .taken = 0, .passes = 0};
+    double *weight = (double *)malloc(sizeof(double) * HISTOGRAM_SIZE);
+    double *value = (double *)malloc(sizeof(double) * HISTOGRAM_SIZE);
+    long long *count = (long long *)malloc(sizeof(long long) * HISTOGRAM_SIZE);
+
+    int shift = 64;      // key bits already fixed: key >> shift == prefix
+    uint64_t prefix = 0;
+    long long critical = -1;
+    int all_fit = 0;
+
+    while (shift > 0)
+    {
+        const int next = (shift > HISTOGRAM_BITS) ? shift - HISTOGRAM_BITS : 0;
+        memset(weight, 0, sizeof(double) * HISTOGRAM_SIZE);
+        memset(value, 0, sizeof(double) * HISTOGRAM_SIZE);
+        memset(count, 0, sizeof(long long) * HISTOGRAM_SIZE);
+
+        uint64_t low = UINT64_MAX, high = 0; // keys of the items still undecided
+        rewind_stream(stream);
+        ans.passes++;
+        STATS_INC(counter[COUNT_PASSES]);
+        size_t got;
+        while ((got = read_block(stream)) > 0)
+        {
+            for (size_t i = 0; i < got; i++)
+            {
+                const double v = stream->block[i].value;
+                const double w = stream->block[i].weight;
+                const uint64_t key = ratio_key(v, w);
+                if (shift < 64 && (key >> shift) != prefix)
+                    continue;
+                low = (key < low) ? key : low;
+                high = (key > high) ? key : high;
+                const int b = (int)((key >> next) & (HISTOGRAM_SIZE - 1));
+                weight[b] += w;
+                value[b] += v;
+                count[b]++;
+            }
+        }
+
+        int b = HISTOGRAM_SIZE - 1;
+        for (; b >= 0; b--)
+        {
+            if (ans.weight + weight[b] > capacity)
+                break;
+            ans.weight += weight[b];
+            ans.value += value[b];
+            ans.taken += count[b];
+        }
+        if (b < 0)
+        {
+            all_fit = 1;
+            break;
+        }
+        critical = count[b];
+        if (low == high)
+        {
+            // one ratio left: no later pass can split the bucket
+            prefix = low;
+            shift = 0;
+            break;
+        }
+        prefix = (shift < 64) ? (prefix << (shift - next)) | (uint64_t)b : (uint64_t)b;
+        shift = next;
+        if (critical <= CRITICAL_LIMIT)
+            break;
+    }
+
+    if (!all_fit && critical > 0 && shift == 0)
+    {
+        // every item in the bucket has the same ratio, so file order is the
+        // prefix order and the bucket is packed as it streams past
+        rewind_stream(stream);
+        ans.passes++;
+        STATS_INC(counter[COUNT_PASSES]);
+        size_t got;
+        int full = 0;
+        while (!full && (got = read_block(stream)) > 0)
+        {
+            for (size_t i = 0; i < got && !full; i++)
+            {
+                const double v = stream->block[i].value;
+                const double w = stream->block[i].weight;
+                if (ratio_key(v, w) != prefix)
+                    continue;
+                if (ans.weight + w > capacity)
+                {
+                    STATS_INC(counter[COUNT_REJECTED]);
+                    full = 1;
+                    continue;
+                }
+                STATS_INC(counter[COUNT_SELECTED]);
+                ans.weight += w;
+                ans.value += v;
+                ans.taken++;
+            }
+        }
+    }
+    else if (!all_fit && critical > 0)
+    {
+        Candidate *group = (Candidate *)malloc(sizeof(Candidate) * critical);
+        long long m = 0;
+        long long index = 0;
+        rewind_stream(stream);
+        ans.passes++;
+        STATS_INC(counter[COUNT_PASSES]);
+        size_t got;
+        while ((got = read_block(stream)) > 0)
+        {
+            for (size_t i = 0; i < got; i++, index++)
+            {
+                const double v = stream->block[i].value;
+                const double w = stream->block[i].weight;
+                if ((ratio_key(v, w) >> shift) == prefix && m < critical)
+                    group[m++] = (Candidate){.value = v, .weight = w, .index = index};
+            }
+        }
+        qsort(group, m, sizeof(Candidate), compare_candidate);
+        for (long long i = 0; i < m; i++)
+        {
+            if (ans.weight + group[i].weight > capacity)
+            {
+                STATS_INC(counter[COUNT_REJECTED]);
+                break;
+            }
+            STATS_INC(counter[COUNT_SELECTED]);
+            ans.weight += group[i].weight;
+            ans.value += group[i].value;
+            ans.taken++;
+        }
+        free(group);
+    }
+
+    free(weight);
+    free(value);
+    free(count);
+    STATS_TIMER_END(t_stream, phase[PHASE_STREAM]);
+    return ans;
+}
+
+// weights are sums of decimal fractions; a total that rounds a hair above
+// the capacity still fits
+#define WEIGHT_TOLERANCE 1.0E-9
+
+// Three-way partition of item[low..high] around the ratio of a median-of-three
+// pivot, in decreasing ratio order. On return item[low..*lt-1] have a larger
+// ratio, item[*lt..*gt] the pivot's and item[*gt+1..high] a smaller one. The
+// three are drawn at random: the ranges left behind by earlier partitions are
+// ordered in ways that defeat fixed positions.
+static void partition_ratio(Item *item, int low, int high, int *lt, int *gt)
+{
+    const int span = high - low + 1;
+    double a = item[low + rand() % span].ratio, b = item[low + rand() % span].ratio,
+           c = item[low + rand() % span].ratio;
+    const double pivot = (a < b) ? ((b < c) ? b : (a < c) ? c : a) : ((a < c) ? a : (b < c) ? c : b);
+
+    int i = low;
+    *lt = low;
+    *gt = high;
+    while (i <= *gt)
+    {
+        if (item[i].ratio > pivot)
+            swap(&item[(*lt)++], &item[i++]);
+        else if (item[i].ratio < pivot)
+            swap(&item[i], &item[(*gt)--]);
+        else
+            i++;
+    }
+}
+
+// Rearranges item[low..high] so that item[k] holds the item of the k-th
+// largest ratio, larger ratios before it and smaller ones after (quickselect).
+void select_ratio(Item *item, int low, int high, int k)
+{
+    while (low < high)
+    {
+        int lt, gt;
+        partition_ratio(item, low, high, &lt, &gt);
+        if (k < lt)
+            high = lt - 1;
+        else if (k > gt)
+            low = gt + 1;
+        else
+            return;
+    }
+}
+
+// Finds the break item by weighted quickselect: afterwards item[0..b-1] all
+// have a ratio no smaller than item[b..n-1] and fit into capacity, while
+// item[b] does not fit on top of them. Returns n if everything fits.
+int find_break(Item *item, int n, double capacity)
+{
+    int low = 0, high = n - 1;
+    double used = 0.0;
+    while (low <= high)
+    {
+        int lt, gt;
+        partition_ratio(item, low, high, &lt, &gt);
+        double above = 0.0;
+        for (int i = low; i < lt; i++)
+            above += item[i].weight;
+        if (used + above > capacity + WEIGHT_TOLERANCE)
+        {
+            high = lt - 1;
+            continue;
+        }
+        used += above;
+        int i = lt;
+        while (i <= gt && used + item[i].weight <= capacity + WEIGHT_TOLERANCE)
+            used += item[i++].weight;
+        if (i <= gt)
+            return i;
+        low = gt + 1;
+    }
+    return low;
+}
+
+// One non-dominated partial solution. Its weight and value count every item
+// above the core as taken; the core items flipped from that are a chain in the
+// trail arena, so states share their common history.
+typedef struct state
+{
+    double weight;
+    double value;
+    int trail;
+} State;
+
+typedef struct trail
+{
+    int item;
+    int parent;
+} Trail;
+
+#define STATE_LIMIT (1 << 22) // states kept at once before the search gives up
+
+// The states of the expanding core, sorted by weight with value strictly
+// increasing (every other state is dominated), and the best feasible one seen.
+typedef struct states
+{
+    State *list;
+    State *next;
+    size_t used;
+    size_t limit; // list holds limit states, next twice as many
+    Trail *arena;
+    size_t arena_used;
+    size_t arena_limit;
+    double capacity;
+    double slack;     // weights closer than this are equal
+    double tolerance; // values closer than this are equal
+    double best;
+    int best_trail;
+} States;
+
+// A block of items next to the core in the order the core takes them up:
+// item[0], item[step], item[2 * step], ... with step 1 below the core (best
+// ratio first) and -1 above it (worst ratio first). Every item past the block
+// has a ratio on the far side of beyond.
+typedef struct block
+{
+    const Item *item;
+    int step;
+    int size;
+    int used;       // items already in the core
+    double *weight; // weight[k], value[k]: totals of the first k items
+    double *value;
+    double beyond;
+} Block;
+
+// LP value of the next x weight of a block's items, in order, then at ratio
+// beyond: the most the items below the core can add to a state with room x,
+// or the least the items above it lose to shed x. Less than slack left over
+// is rounding and costs nothing.
+static double block_fill(const Block *bl, double x, double slack)
+{
+    const double base = bl->weight[bl->used];
+    int low = bl->used, high = bl->size; // last prefix that fits whole
+    while (low < high)
+    {
+        const int mid = (low + high + 1) / 2;
+        if (bl->weight[mid] - base <= x)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    const double fill = bl->value[low] - bl->value[bl->used];
+    const double left = x - (bl->weight[low] - base);
+    if (left <= slack)
+        return fill;
+    return fill + left * ((low < bl->size) ? bl->item[low * bl->step].ratio : bl->beyond);
+}
+
+static void block_sums(Block *bl)
+{
+    bl->weight = (double *)realloc(bl->weight, (bl->size + 1) * sizeof(double));
+    bl->value = (double *)realloc(bl->value, (bl->size + 1) * sizeof(double));
+    assert(bl->weight != NULL && bl->value != NULL);
+    bl->weight[0] = bl->value[0] = 0.0;
+    for (int k = 0; k < bl->size; k++)
+    {
+        bl->weight[k + 1] = bl->weight[k] + bl->item[k * bl->step].weight;
+        bl->value[k + 1] = bl->value[k] + bl->item[k * bl->step].value;
+    }
+    bl->used = 0;
+}
+
+static int compare_item_ratio_desc(const void *p, const void *q)
+{
+    const double a = ((const Item *)p)->ratio;
+    const double b = ((const Item *)q)->ratio;
+    return (a < b) - (a > b);
+}
+
+// Makes the (at most) size best items of item[t..n-1] the next block below
+// the core: quickselect finds them and only they are sorted.
+static void block_below(Item *item, int n, int t, int size, Block *bl)
+{
+    const int end = (t + size < n) ? t + size : n;
+    if (end < n)
+        select_ratio(item, t, n - 1, end);
+    qsort(item + t, end - t, sizeof(Item), compare_item_ratio_desc);
+    bl->item = item + t;
+    bl->step = 1;
+    bl->size = end - t;
+    bl->beyond = (end < n) ? item[end - 1].ratio : 0.0; // nothing left to add
+    block_sums(bl);
+}
+
+// Makes the (at most) size worst items of item[0..s-1] the next block above
+// the core.
+static void block_above(Item *item, int s, int size, Block *bl)
+{
+    const int begin = (s - size > 0) ? s - size : 0;
+    if (begin > 0)
+        select_ratio(item, 0, s - 1, begin);
+    qsort(item + begin, s - begin, sizeof(Item), compare_item_ratio_desc);
+    bl->item = (s > 0) ? item + s - 1 : item;
+    bl->step = -1;
+    bl->size = s - begin;
+    bl->beyond = (begin > 0) ? item[begin].ratio : INFINITY; // nothing left to shed
+    block_sums(bl);
+}
+
+// Drops the trail entries that no state or the incumbent reaches and
+// renumbers the rest. A parent always precedes its children, so the arena
+// is compacted in place in one forward sweep.
+static void compact_trail(States *st)
+{
+    int *map = (int *)malloc((st->arena_used > 0 ? st->arena_used : 1) * sizeof(int));
+    assert(map != NULL);
+    for (size_t k = 0; k < st->arena_used; k++)
+        map[k] = -1;
+    for (size_t i = 0; i <= st->used; i++)
+    {
+        int k = (i < st->used) ? st->list[i].trail : st->best_trail;
+        for (; k >= 0 && map[k] < 0; k = st->arena[k].parent)
+            map[k] = 0;
+    }
+    size_t kept = 0;
+    for (size_t k = 0; k < st->arena_used; k++)
+    {
+        if (map[k] < 0)
+            continue;
+        const int parent = st->arena[k].parent;
+        st->arena[kept] = (Trail){.item = st->arena[k].item, .parent = (parent >= 0) ? map[parent] : -1};
+        map[k] = (int)kept++;
+    }
+    for (size_t i = 0; i < st->used; i++)
+        if (st->list[i].trail >= 0)
+            st->list[i].trail = map[st->list[i].trail];
+    if (st->best_trail >= 0)
+        st->best_trail = map[st->best_trail];
+    st->arena_used = kept;
+    free(map);
+}
+
+// Flips core item i in every state (adds it, or takes it out of the items
+// above the core when sign is -1) and merges the result into the list. A state
+// survives only if its LP bound beats the incumbent: a feasible state fills
+// its room from the block below the core, an overweight one sheds its excess
+// into the block above it. Only surviving states get a trail entry.
+static void flip_item(States *st, const Item *item, int i, double sign, const Block *below, const Block *above)
+{
+    const double dw = sign * item[i].weight;
+    const double dv = sign * item[i].value;
+    if (st->arena_used + st->used > st->arena_limit)
+    {
+        compact_trail(st);
+        while (2 * (st->arena_used + st->used) > st->arena_limit)
+            st->arena_limit *= 2;
+        st->arena = (Trail *)realloc(st->arena, st->arena_limit * sizeof(Trail));
+        assert(st->arena != NULL);
+    }
+
+    const State *list = st->list;
+    const size_t used = st->used;
+    size_t a = 0, b = 0, count = 0;
+    while (a < used || b < used)
+    {
+        State s;
+        int flipped = 0;
+        if (b < used && (a >= used || list[b].weight + dw < list[a].weight))
+        {
+            s = (State){.weight = list[b].weight + dw, .value = list[b].value + dv, .trail = list[b].trail};
+            flipped = 1;
+            b++;
+        }
+        else
+            s = list[a++];
+        STATS_INC(counter[COUNT_CORE_NODES]);
+
+        // totals that differ only by rounding count as equal
+        if (count > 0 && s.value <= st->next[count - 1].value + st->tolerance)
+            continue;
+        const int feasible = (s.weight <= st->capacity + st->slack);
+        const int better = feasible && s.value > st->best;
+        const double bound = feasible ? s.value + block_fill(below, st->capacity - s.weight, st->slack)
+                                      : s.value - block_fill(above, s.weight - st->capacity, st->slack);
+        const int keep = (bound > (better ? s.value : st->best) + st->tolerance);
+        if (flipped && (better || keep))
+        {
+            st->arena[st->arena_used] = (Trail){.item = i, .parent = s.trail};
+            s.trail = (int)st->arena_used++;
+        }
+        if (better)
+        {
+            st->best = s.value;
+            st->best_trail = s.trail;
+        }
+        if (!keep)
+            continue;
+        while (count > 0 && st->next[count - 1].weight >= s.weight - st->slack)
+            count--;
+        st->next[count++] = s;
+    }
+
+    State *swap = st->list;
+    st->list = st->next;
+    st->next = swap;
+    st->used = count;
+    if (2 * st->used > st->limit)
+    {
+        st->limit = 2 * st->used;
+        st->list = (State *)realloc(st->list, st->limit * sizeof(State));
+        st->next = (State *)realloc(st->next, 2 * st->limit * sizeof(State));
+        assert(st->list != NULL && st->next != NULL);
+    }
+}
+
+// Exact 0/1 knapsack by an expanding core, after Pisinger's minknap. The
+// greedy solution takes every item above the break item and none below it.
+// The core item[s..t-1] grows one item at a time on either side, alternating:
+// item t may be added and item s-1 taken back out, and each step updates one
+// list of states by dynamic programming (see flip_item). The list is carried
+// from step to step, never rebuilt. Once it is empty no state can beat the
+// incumbent, which is then optimal for the whole set. The items next to the
+// core are found by quickselect in blocks that double in size, and only those
+// blocks are sorted; the rest of the items are never ordered. A search whose
+// list outgrows STATE_LIMIT stops with the incumbent, unproven.
+Exact core_search(Itemset *list, double capacity, unsigned char *flags)
+{
+    STATS_TIMER_BEGIN(t_sort);
+    Item *item = list->item;
+    const int n = list->number;
+    const int b = find_break(item, n, capacity);
+    STATS_TIMER_END(t_sort, phase[PHASE_SORT]);
+
+    Exact ans = {.value = 0.0, .weight = 0.0, .taken = 0, .core = 0, .expansions = 0, .proven = 1};
+    for (int i = 0; i < b; i++)
+    {
+        ans.value += item[i].value;
+        ans.weight += item[i].weight;
+        flags[item[i].label - 1] = 1;
+    }
+    ans.taken = b;
+    if (b == n)
+        return ans;
+
+    STATS_TIMER_BEGIN(t_select);
+    const double upper = ans.value + (capacity - ans.weight) * item[b].ratio;
+    // state totals run over every item above the core, so their rounding
+    // grows with the capacity and the optimum, not with the core
+    States st = {.used = 1, .limit = 1024, .arena_used = 0, .arena_limit = 1024, .capacity = capacity,
+                 .slack = 1.0E-9 * (1.0 + capacity), .tolerance = 1.0E-9 * (1.0 + upper),
+                 .best = ans.value, .best_trail = -1};
+    st.list = (State *)malloc(st.limit * sizeof(State));
+    st.next = (State *)malloc(2 * st.limit * sizeof(State));
+    st.arena = (Trail *)malloc(st.arena_limit * sizeof(Trail));
+    assert(st.list != NULL && st.next != NULL && st.arena != NULL);
+    st.list[0] = (State){.weight = ans.weight, .value = ans.value, .trail = -1};
+
+    // the core is item[s..t-1]; a block always waits on either side of it
+    int s = b, t = b;
+    Block below = {.weight = NULL, .value = NULL}, above = {.weight = NULL, .value = NULL};
+    block_below(item, n, t, 16, &below);
+    block_above(item, s, 16, &above);
+    while (st.used > 0 && st.best < upper - st.tolerance && (s > 0 || t < n))
+    {
+        if (t < n)
+        {
+            t++;
+            if (++below.used == below.size && t < n)
+            {
+                block_below(item, n, t, 2 * below.size, &below);
+                ans.expansions++;
+                STATS_INC(counter[COUNT_EXPANSIONS]);
+            }
+            flip_item(&st, item, t - 1, 1.0, &below, &above);
+        }
+        if (s > 0 && st.used > 0)
+        {
+            s--;
+            if (++above.used == above.size && s > 0)
+            {
+                block_above(item, s, 2 * above.size, &above);
+                ans.expansions++;
+                STATS_INC(counter[COUNT_EXPANSIONS]);
+            }
+            flip_item(&st, item, s, -1.0, &below, &above);
+        }
+        if (st.used > STATE_LIMIT)
+        {
+            ans.proven = 0;
+            break;
+        }
+    }
+
+    for (int k = st.best_trail; k >= 0; k = st.arena[k].parent)
+    {
+        const Item *it = &item[st.arena[k].item];
+        const int in = (st.arena[k].item >= b); // flipped into the knapsack
+        flags[it->label - 1] = (unsigned char)in;
+        ans.weight += in ? it->weight : -it->weight;
+        ans.taken += in ? 1 : -1;
+    }
+    ans.value = st.best;
+    ans.core = t - s;
+    free(st.list);
+    free(st.next);
+    free(st.arena);
+    free(below.weight);
+    free(below.value);
+    free(above.weight);
+    free(above.value);
+    STATS_TIMER_END(t_select, phase[PHASE_SELECT]);
+    return ans;
+}
@@ -0,0 +1,161 @@
+#!/bin/sh
+# Runs fixed-seed instance families through every solver mode and prints one
+# CSV row per run:
+#   program,mode,size,seed,param,seconds,result,throughput
+# seconds is the solve time the program reports with --stats=json: the sum of
+# the phases named for the mode, so loading, instance generation and printing
+# are left out. Solver output goes to a scratch file and is only read for the
+# result, which is the tour length (tsp1; the sum over instances for batch) or
+# the packed value (knapsack1, advance). throughput is restarts/s for tsp1,
+# offspring/s for genetic, instances/s for batch and items/s for the knapsack
+# solvers.
+#
+# usage: bench.sh [bin dir]    (default: build/release, built with stats)
+# The instance sizes can be overridden through TSP_SIZES, TSP_LARGE_SIZES,
+# GENETIC_SIZES, BATCH_INSTANCES, KNAPSACK_SIZES, TABLE_SIZES, ADVANCE_SIZES,
+# SEEDS, TSP_RESTARTS, LARGE_RESTARTS, EPSILON and CAPACITY.
+
+set -eu
+
+BIN=${1:-build/release}
+TSP_SIZES=${TSP_SIZES:-"20 50 100"}
+TSP_RESTARTS=${TSP_RESTARTS:-100}
+TSP_LARGE_SIZES=${TSP_LARGE_SIZES:-"1000 5000"}
+LARGE_RESTARTS=${LARGE_RESTARTS:-3}
+GENETIC_SIZES=${GENETIC_SIZES:-"200 1000"}
+BATCH_INSTANCES=${BATCH_INSTANCES:-200}
+KNAPSACK_SIZES=${KNAPSACK_SIZES:-"12 16 20"}
+TABLE_SIZES=${TABLE_SIZES:-"300 1000"}
+ADVANCE_SIZES=${ADVANCE_SIZES:-"1000 10000 100000"}
+SEEDS=${SEEDS:-"1 2 3"}
+EPSILON=${EPSILON:-0.1}
+CAPACITY=${CAPACITY:-200}
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+# solve_seconds <stats file> <phase...>: sums the named phases of the JSON
+solve_seconds() {
+    file=$1
+    shift
+    if ! grep -q '"enabled": true' "$file"; then
+        echo "$0: $BIN was built without stats" >&2
+        exit 1
+    fi
+    tr -d '\n' < "$file" | awk -v want="$*" '{
+        match($0, /"phases": \{[^}]*\}/)
+        p = substr($0, RSTART, RLENGTH)
+        n = split(want, w, " ")
+        t = 0
+        for (i = 1; i <= n; i++)
+            if (match(p, "\"" w[i] "\": [0-9.eE+-]+")) {
+                x = substr(p, RSTART, RLENGTH)
+                sub(/.*: /, "", x)
+                t += x
+            }
+        printf "%.6f", t
+    }'
+}
+
+# run <phases> <command...>: runs the command with --stats=json, its output in
+# $TMP/out, and prints the solve seconds
+run() {
+    phases=$1
+    shift
+    "$@" --stats=json > "$TMP/out" 2> "$TMP/stats"
+    solve_seconds "$TMP/stats" $phases
+}
+
+row() {
+    # row <program> <mode> <size> <seed> <param> <seconds> <result> <units per run>
+    awk -v p="$1" -v m="$2" -v n="$3" -v seed="$4" -v param="$5" -v s="$6" -v r="$7" -v u="$8" \
+        'BEGIN { printf "%s,%s,%s,%s,%s,%.6f,%s,%.1f\n", p, m, n, seed, param, s, r, (s > 0) ? u / s : 0 }'
+}
+
+tour_length() {
+    sed -n 's/^total distance = //p' "$TMP/out"
+}
+
+packed_value() {
+    sed -n 's/^value: *//p' "$TMP/out"
+}
+
+echo "program,mode,size,seed,param,seconds,result,throughput"
+
+for n in $TSP_SIZES; do
+    for seed in $SEEDS; do
+        "$BIN/gencity" "$n" "$seed" "$TMP/city.bin"
+        s=$(run "construct local_search" "$BIN/tsp1" --seed="$seed" "$TMP/city.bin" "$TSP_RESTARTS")
+        row tsp1 swap "$n" "$seed" "$TSP_RESTARTS" "$s" "$(tour_length)" "$TSP_RESTARTS"
+    done
+done
+
+for n in $TSP_LARGE_SIZES; do
+    for seed in $SEEDS; do
+        "$BIN/gencity" --width=10000 --height=10000 "$n" "$seed" "$TMP/city.bin"
+        for search in 2opt lk; do
+            s=$(run "construct local_search" "$BIN/tsp1" --local-search=$search --seed="$seed" \
+                "$TMP/city.bin" "$LARGE_RESTARTS")
+            row tsp1 "$search" "$n" "$seed" "$LARGE_RESTARTS" "$s" "$(tour_length)" "$LARGE_RESTARTS"
+        done
+    done
+done
+
+for n in $GENETIC_SIZES; do
+    for seed in $SEEDS; do
+        "$BIN/gencity" --width=10000 --height=10000 "$n" "$seed" "$TMP/city.bin"
+        s=$(run "construct local_search" "$BIN/tsp1" --genetic --population=30 --generations=50 --seed="$seed" \
+            "$TMP/city.bin")
+        row tsp1 genetic "$n" "$seed" 30x50 "$s" "$(tour_length)" $((30 * 51))
+    done
+done
+
+for seed in $SEEDS; do
+    : > "$TMP/list.txt"
+    i=0
+    while [ $i -lt "$BATCH_INSTANCES" ]; do
+        "$BIN/gencity" 50 $((seed * 100000 + i)) "$TMP/batch$i.bin"
+        echo "$TMP/batch$i.bin" >> "$TMP/list.txt"
+        i=$((i + 1))
+    done
+    s=$(run "construct local_search" "$BIN/tsp1" --batch="$TMP/list.txt" --local-search=2opt --seed="$seed" 3)
+    d=$(awk -F '\t' '{ t += $3 } END { printf "%f", t }' "$TMP/out")
+    row tsp1 batch 50 "$seed" "${BATCH_INSTANCES}x3" "$s" "$d" "$BATCH_INSTANCES"
+done
+
+for n in $KNAPSACK_SIZES; do
+    for seed in $SEEDS; do
+        "$BIN/advance" --seed="$seed" --save="$TMP/items.bin" "$n" 0 > /dev/null
+        s=$(run search "$BIN/knapsack1" --quiet "$TMP/items.bin" "$CAPACITY")
+        row knapsack1 exhaustive "$n" "$seed" "$CAPACITY" "$s" "$(packed_value)" "$n"
+    done
+done
+
+echo "$CAPACITY" > "$TMP/capacities"
+for n in $TABLE_SIZES; do
+    for seed in $SEEDS; do
+        "$BIN/advance" --seed="$seed" --save="$TMP/items.bin" "$n" 0 > /dev/null
+        s=$(run "search query" "$BIN/knapsack1" --query "$TMP/items.bin" < "$TMP/capacities")
+        row knapsack1 query "$n" "$seed" "$CAPACITY" "$s" "$(cut -f 2 "$TMP/out")" "$n"
+    done
+done
+
+for n in $ADVANCE_SIZES; do
+    for seed in $SEEDS; do
+        "$BIN/advance" --seed="$seed" --save="$TMP/items.bin" "$n" 0 > /dev/null
+        s=$(run search "$BIN/knapsack1" --epsilon="$EPSILON" "$TMP/items.bin" "$CAPACITY")
+        row knapsack1 "epsilon=$EPSILON" "$n" "$seed" "$CAPACITY" "$s" "$(packed_value)" "$n"
+
+        s=$(run "sort select" "$BIN/advance" --seed="$seed" "$n" "$CAPACITY")
+        row advance greedy "$n" "$seed" "$CAPACITY" "$s" "$(packed_value)" "$n"
+
+        s=$(run "sort select" "$BIN/advance" --exact --seed="$seed" "$n" "$CAPACITY")
+        row advance exact "$n" "$seed" "$CAPACITY" "$s" "$(packed_value)" "$n"
+
+        s=$(run "sort select query" "$BIN/advance" --query --seed="$seed" "$n" < "$TMP/capacities")
+        row advance query "$n" "$seed" "$CAPACITY" "$s" "$(cut -f 2 "$TMP/out")" "$n"
+
+        s=$(run stream "$BIN/advance" --stream="$TMP/items.bin" "$CAPACITY")
+        row advance stream "$n" "$seed" "$CAPACITY" "$s" "$(packed_value)" "$n"
+    done
+done
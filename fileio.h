@@ -0,0 +1,265 @@
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Binary item files (int n, then n pairs of double value, weight) and city
+// files (int n, then n pairs of int x, y), read and written straight through
+// file descriptors in large blocks. Every error is reported with the file
+// name and ends the program.
+
+#define FILEIO_BLOCK (8 << 20)
+
+typedef struct
+{
+    double value;
+    double weight;
+} ItemRecord;
+
+typedef struct
+{
+    int x;
+    int y;
+} CityRecord;
+
+typedef struct
+{
+    const char *filename;
+    int fd;
+    char *buffer; // size bytes, page aligned
+    size_t size;
+    size_t begin; // unread bytes are buffer[begin..end)
+    size_t end;
+    unsigned long long bytes; // read from the file so far
+} BlockReader;
+
+typedef struct
+{
+    const char *filename;
+    int fd;
+    char *buffer;
+    size_t used;
+} BlockWriter;
+
+static inline char *fileio_buffer(size_t size)
+{
+    void *buffer;
+    if (posix_memalign(&buffer, 4096, size) != 0)
+    {
+        fprintf(stderr, "cannot allocate an I/O buffer.\n");
+        exit(1);
+    }
+    return (char *)buffer;
+}
+
+// Reads up to size bytes with as few read calls as the kernel allows.
+static inline size_t fileio_read(BlockReader *r, char *dst, size_t size)
+{
+    size_t got = 0;
+    while (got < size)
+    {
+        const ssize_t k = read(r->fd, dst + got, size - got);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k < 0)
+        {
+            fprintf(stderr, "%s: %s\n", r->filename, strerror(errno));
+            exit(1);
+        }
+        if (k == 0)
+            break;
+        got += k;
+    }
+    r->bytes += got;
+    return got;
+}
+
+static inline BlockReader *open_reader(const char *filename)
+{
+    BlockReader *r = (BlockReader *)malloc(sizeof(BlockReader));
+    *r = (BlockReader){.filename = filename, .fd = open(filename, O_RDONLY), .buffer = NULL,
+                       .size = FILEIO_BLOCK, .begin = 0, .end = 0, .bytes = 0};
+    if (r->fd < 0)
+    {
+        fprintf(stderr, "%s: cannot open file.\n", filename);
+        exit(1);
+    }
+    posix_fadvise(r->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    // a small file (a batch instance, say) gets a buffer of its own size
+    struct stat st;
+    if (fstat(r->fd, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size < FILEIO_BLOCK)
+        r->size = ((size_t)st.st_size / 4096 + 1) * 4096;
+    r->buffer = fileio_buffer(r->size);
+    return r;
+}
+
+static inline void rewind_reader(BlockReader *r)
+{
+    if (lseek(r->fd, 0, SEEK_SET) != 0)
+    {
+        fprintf(stderr, "%s: %s\n", r->filename, strerror(errno));
+        exit(1);
+    }
+    r->begin = r->end = 0;
+}
+
+static inline void close_reader(BlockReader *r)
+{
+    close(r->fd);
+    free(r->buffer);
+    free(r);
+}
+
+// Copies the next size bytes to dst and returns how many there were, fewer
+// only at the end of the file. Large requests bypass the buffer.
+static inline size_t read_bytes(BlockReader *r, void *dst, size_t size)
+{
+    char *p = (char *)dst;
+    size_t got = r->end - r->begin;
+    if (got >= size)
+    {
+        memcpy(p, r->buffer + r->begin, size);
+        r->begin += size;
+        return size;
+    }
+    memcpy(p, r->buffer + r->begin, got);
+    r->begin = r->end = 0;
+    if (size - got >= r->size)
+        return got + fileio_read(r, p + got, size - got);
+    r->end = fileio_read(r, r->buffer, r->size);
+    const size_t rest = (r->end < size - got) ? r->end : size - got;
+    memcpy(p + got, r->buffer, rest);
+    r->begin = rest;
+    return got + rest;
+}
+
+// Reads the record count that starts every file image. Returns -1 at the end
+// of the file.
+static inline int read_count(BlockReader *r)
+{
+    int n;
+    const size_t got = read_bytes(r, &n, sizeof(int));
+    if (got == 0)
+        return -1;
+    if (got != sizeof(int) || n < 0)
+    {
+        fprintf(stderr, "%s: invalid header.\n", r->filename);
+        exit(1);
+    }
+    return n;
+}
+
+static inline void read_records(BlockReader *r, void *dst, size_t size, size_t n)
+{
+    if (read_bytes(r, dst, size * n) != size * n)
+    {
+        fprintf(stderr, "%s: truncated file.\n", r->filename);
+        exit(1);
+    }
+}
+
+// Returns the buffered records as they are, refilling the buffer when fewer
+// than one is left: *n is set to their number, 0 at the end of the file. The
+// pointer stays valid until the next read.
+static inline const void *next_records(BlockReader *r, size_t size, size_t *n)
+{
+    if (r->end - r->begin < size || r->begin % sizeof(double) != 0)
+    {
+        // keep the records aligned at the start of the buffer
+        const size_t left = r->end - r->begin;
+        memmove(r->buffer, r->buffer + r->begin, left);
+        r->begin = 0;
+        r->end = left + fileio_read(r, r->buffer + left, r->size - left);
+    }
+    *n = (r->end - r->begin) / size;
+    if (*n == 0 && r->end > r->begin)
+    {
+        fprintf(stderr, "%s: truncated file.\n", r->filename);
+        exit(1);
+    }
+    const void *p = r->buffer + r->begin;
+    r->begin += *n * size;
+    return p;
+}
+
+static inline BlockWriter *open_writer(const char *filename)
+{
+    BlockWriter *w = (BlockWriter *)malloc(sizeof(BlockWriter));
+    *w = (BlockWriter){.filename = filename, .fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666),
+                       .buffer = NULL, .used = 0};
+    if (w->fd < 0)
+    {
+        fprintf(stderr, "%s: cannot open file.\n", filename);
+        exit(1);
+    }
+    w->buffer = fileio_buffer(FILEIO_BLOCK);
+    return w;
+}
+
+static inline void fileio_write(BlockWriter *w, const char *src, size_t size)
+{
+    while (size > 0)
+    {
+        const ssize_t k = write(w->fd, src, size);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k < 0)
+        {
+            fprintf(stderr, "%s: %s\n", w->filename, strerror(errno));
+            exit(1);
+        }
+        src += k;
+        size -= k;
+    }
+}
+
+// Appends size bytes; large blocks go straight to the file.
+static inline void write_bytes(BlockWriter *w, const void *src, size_t size)
+{
+    if (w->used + size > FILEIO_BLOCK)
+    {
+        fileio_write(w, w->buffer, w->used);
+        w->used = 0;
+    }
+    if (size >= FILEIO_BLOCK)
+        fileio_write(w, (const char *)src, size);
+    else
+    {
+        memcpy(w->buffer + w->used, src, size);
+        w->used += size;
+    }
+}
+
+static inline void close_writer(BlockWriter *w)
+{
+    fileio_write(w, w->buffer, w->used);
+    if (close(w->fd) != 0)
+    {
+        fprintf(stderr, "%s: %s\n", w->filename, strerror(errno));
+        exit(1);
+    }
+    free(w->buffer);
+    free(w);
+}
+
+static inline void write_count(BlockWriter *w, int n)
+{
+    write_bytes(w, &n, sizeof(int));
+}
+
+// Writes a whole city file.
+static inline void save_city_file(const char *filename, const CityRecord *city, int n)
+{
+    BlockWriter *w = open_writer(filename);
+    write_count(w, n);
+    write_bytes(w, city, sizeof(CityRecord) * n);
+    close_writer(w);
+}
+
+#endif
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include "fileio.h"
 
 int load_int(const char *argvalue)
 {
@@ -25,38 +26,46 @@ int load_int(const char *argvalue)
 
 int main(int argc, char **argv)
 {
-    const int width = 70;
-    const int height = 40;
-    const int max_cities = 100;
+    // the default area fits tsp1's map; larger instances need a larger one
+    int width = 70;
+    int height = 40;
+    const int max_cities = 100000;
 
-    if (argc != 4)
+    char *args[argc];
+    int nargs = 0;
+    for (int i = 1; i < argc; i++)
     {
-        fprintf(stderr, "usage: %s <number of cities> <random seed> <outputfilename>\n", argv[0]);
+        if (strncmp(argv[i], "--width=", 8) == 0)
+            width = load_int(argv[i] + 8);
+        else if (strncmp(argv[i], "--height=", 9) == 0)
+            height = load_int(argv[i] + 9);
+        else if (strncmp(argv[i], "--", 2) == 0)
+        {
+            fprintf(stderr, "%s: unknown option.\n", argv[i]);
+            exit(1);
+        }
+        else
+            args[nargs++] = argv[i];
+    }
+    if (nargs != 3)
+    {
+        fprintf(stderr, "usage: %s [--width=W] [--height=H] <number of cities> <random seed> <outputfilename>\n", argv[0]);
         return EXIT_FAILURE;
     }
-    int nc = load_int(argv[1]);
+    int nc = load_int(args[0]);
     assert(nc > 1 && nc <= max_cities);
-    int seed = load_int(argv[2]);
+    assert(width > 10 && height > 10);
+    int seed = load_int(args[1]);
     srand(seed);
 
-    int *data = (int *)malloc(sizeof(int) * 2 * nc);
+    CityRecord *data = (CityRecord *)malloc(sizeof(CityRecord) * nc);
     for (int i = 0; i < nc; i++)
     {
-        data[2 * i] = rand() % (width - 10) + 5;
-        ;
-        data[2 * i + 1] = rand() % (height - 10) + 5;
-        ;
-    }
-
-    FILE *fp;
-    if ((fp = fopen(argv[3], "wb")) == NULL)
-    {
-        fprintf(stderr, "%s: cannot open file.\n", argv[3]);
-        return EXIT_FAILURE;
+        data[i].x = rand() % (width - 10) + 5;
+        data[i].y = rand() % (height - 10) + 5;
     }
-    fwrite(&nc, sizeof(int), 1, fp);
-    fwrite(data, sizeof(int), 2 * nc, fp);
-    fclose(fp);
+    save_city_file(args[2], data, nc);
+    free(data);
 
     return EXIT_SUCCESS;
 }
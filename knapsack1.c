@@ -3,6 +3,8 @@
 #include <assert.h>
 #include <string.h>
 #include <errno.h> 
+#include "stats.h"
+#include "fileio.h"
 
 typedef struct item
 {
@@ -16,6 +18,14 @@ typedef struct itemset
     Item *item;
 } Itemset;
 
+// Best value for every integral capacity 0..capacity, in units of 1/scale.
+typedef struct table
+{
+    int scale;
+    int capacity;
+    double *best;
+} Table;
+
 Itemset *init_itemset(int number, int seed);
 void free_itemset(Itemset *list);
 Itemset *load_itemset(char *filename);
@@ -26,6 +36,31 @@ double search(int index, const Itemset *list, double capacity, unsigned char *fl
 int load_int(const char *argvalue);
 double load_double(const char *argvalue);
 
+Table *build_table(const Itemset *list, int scale);
+void free_table(Table *table);
+void run_queries(const Table *table, FILE *fp);
+double fptas(const Itemset *list, double capacity, double epsilon, unsigned char *flags, double *bound);
+
+enum { PHASE_LOAD, PHASE_SEARCH, PHASE_QUERY, PHASE_OUTPUT, N_PHASE };
+enum { COUNT_NODES, COUNT_LEAVES, COUNT_FEASIBLE, COUNT_PRUNED, COUNT_CELLS, COUNT_QUERIES, N_COUNTER };
+
+StatsPhase phase[N_PHASE] = {
+    [PHASE_LOAD] = {"load"},
+    [PHASE_SEARCH] = {"search"},
+    [PHASE_QUERY] = {"query"},
+    [PHASE_OUTPUT] = {"output"},
+};
+StatsCounter counter[N_COUNTER] = {
+    [COUNT_NODES] = {"nodes"},
+    [COUNT_LEAVES] = {"leaves"},
+    [COUNT_FEASIBLE] = {"feasible_leaves"},
+    [COUNT_PRUNED] = {"pruned"},
+    [COUNT_CELLS] = {"table_cells"},
+    [COUNT_QUERIES] = {"queries"},
+};
+
+int quiet = 0; // --quiet: no item list and no line per leaf
+
 int load_int(const char *argvalue)
 {
     long nl;
@@ -66,46 +101,60 @@ double load_double(const char *argvalue)
 
 Itemset *load_itemset(char *filename)
 {
-    Itemset *itemset = NULL;
-    Item *items = NULL;
-    FILE *fp = NULL;
-    int n = 0;
-    if ((fp = fopen(filename, "rb")) == NULL)
-    {
-        fprintf(stderr, "%s: cannot open file.\n", filename);
-        exit(1);
-    }
-
-    fread(&n, sizeof(int), 1, fp);
+    BlockReader *r = open_reader(filename);
+    const int n = read_count(r);
     assert(n > 0);
-    itemset = (Itemset *)malloc(sizeof(Itemset));
-    items = (Item *)malloc(sizeof(Item) * n);
-
-    for (int i = 0; i < n; i++)
-    {
-        fread(&items[i].value, sizeof(double), 1, fp);
-        fread(&items[i].weight, sizeof(double), 1, fp);
-    }
+    Item *items = (Item *)malloc(sizeof(Item) * n);
+    read_records(r, items, sizeof(Item), n); // Item has the layout of ItemRecord
+    Itemset *itemset = (Itemset *)malloc(sizeof(Itemset));
     *itemset = (Itemset){.number = n, .item = items};
-    fclose(fp);
+    close_reader(r);
 
     return itemset;
 }
 
 int main(int argc, char **argv)
 {
-    if (argc != 3)
+    char *args[argc];
+    int nargs = 0;
+    int show_stats = 0;
+    int query = 0;
+    int scale = 10;
+    double epsilon = 0.0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--stats=json") == 0)
+            show_stats = 1;
+        else if (strcmp(argv[i], "--quiet") == 0)
+            quiet = 1;
+        else if (strcmp(argv[i], "--query") == 0)
+            query = 1;
+        else if (strncmp(argv[i], "--scale=", 8) == 0)
+            scale = load_int(argv[i] + 8);
+        else if (strncmp(argv[i], "--epsilon=", 10) == 0)
+            epsilon = load_double(argv[i] + 10);
+        else if (strncmp(argv[i], "--", 2) == 0)
+        {
+            fprintf(stderr, "%s: unknown option.\n", argv[i]);
+            exit(1);
+        }
+        else
+            args[nargs++] = argv[i];
+    }
+    if (nargs != (query ? 1 : 2))
     {
-        fprintf(stderr, "usage: %s <filename><number>\n", argv[0]);
+        fprintf(stderr, "usage: %s [--quiet] [--stats=json] <filename><number>\n"
+                        "       %s --query [--scale=N] [--stats=json] <filename> < capacities\n"
+                        "       %s --epsilon=E [--stats=json] <filename><number>\n",
+                argv[0], argv[0], argv[0]);
         exit(1);
     }
 
     const int max_items = 100;
-    Itemset *items = load_itemset(argv[1]);
-    const double max_weight = atof(argv[2]);
+    STATS_TIMER_BEGIN(t_load);
+    Itemset *items = load_itemset(args[0]);
+    STATS_TIMER_END(t_load, phase[PHASE_LOAD]);
     const int n = items->number;
-    assert(n <= max_items); 
-    assert(max_weight >= 0);
 
     double check_value = 0;
     double check_weight = 0;
@@ -117,13 +166,78 @@ int main(int argc, char **argv)
         assert(check_weight >= 0.0);
     }
 
+    if (query)
+    {
+        assert(scale > 0);
+        Table *table = build_table(items, scale);
+        run_queries(table, stdin);
+
+        if (show_stats)
+            stats_print_json(stderr, "knapsack1", phase, N_PHASE, counter, N_COUNTER);
+        free_table(table);
+        free_itemset(items);
+        return 0;
+    }
+
+    const double max_weight = atof(args[1]);
+    assert(max_weight >= 0);
+
+    if (epsilon != 0.0)
+    {
+        assert(epsilon > 0.0 && epsilon < 1.0);
+        printf("max capacity: W = %.f, # of items: %d\n", max_weight, n);
+
+        unsigned char *flags = (unsigned char *)calloc(n > 0 ? n : 1, sizeof(unsigned char));
+        double bound;
+        STATS_TIMER_BEGIN(t_search);
+        const double total = fptas(items, max_weight, epsilon, flags, &bound);
+        STATS_TIMER_END(t_search, phase[PHASE_SEARCH]);
+
+        STATS_TIMER_BEGIN(t_output);
+        double weight = 0.0;
+        for (int i = 0; i < n; i++)
+            if (flags[i])
+                weight += items->item[i].weight;
+        printf("----\nbest solution:\n");
+        printf("value: %4.1f\n", total);
+        printf("weight: %4.1f\n", weight);
+        printf("guarantee: value >= %.4f * optimum (epsilon = %g)\n", 1.0 - epsilon, epsilon);
+        printf("upper bound: %4.1f, value >= %.4f * optimum\n", bound, (bound > 0.0) ? total / bound : 1.0);
+        for (int i = 0; i < n; i++)
+            printf("%d", flags[i]);
+        printf("\n");
+        fflush(stdout);
+        STATS_TIMER_END(t_output, phase[PHASE_OUTPUT]);
+
+        if (show_stats)
+            stats_print_json(stderr, "knapsack1", phase, N_PHASE, counter, N_COUNTER);
+        free(flags);
+        free_itemset(items);
+        return 0;
+    }
+
+    assert(n <= max_items); 
+
+    STATS_TIMER_BEGIN(t_header);
     printf("max capacity: W = %.f, # of items: %d\n", max_weight, n);
-    print_itemset(items);
+    if (!quiet)
+        print_itemset(items);
+    STATS_TIMER_END(t_header, phase[PHASE_OUTPUT]);
 
+    // the search prints every leaf, so that output is counted in the search
+    // phase unless --quiet is given
+    STATS_TIMER_BEGIN(t_search);
     double total = solve(items, max_weight);
+    STATS_TIMER_END(t_search, phase[PHASE_SEARCH]);
 
+    STATS_TIMER_BEGIN(t_output);
     printf("----\nbest solution:\n");
     printf("value: %4.1f\n", total);
+    fflush(stdout);
+    STATS_TIMER_END(t_output, phase[PHASE_OUTPUT]);
+
+    if (show_stats)
+        stats_print_json(stderr, "knapsack1", phase, N_PHASE, counter, N_COUNTER);
 
     free_itemset(items);
     return 0;
@@ -173,22 +287,28 @@ double search(int index, const Itemset *list, double capacity, unsigned char *fl
 {
     int max_index = list->number;
     assert(index >= 0 && sum_v >= 0 && sum_w >= 0);
+    STATS_INC(counter[COUNT_NODES]);
     if (index == max_index)
     {
+        STATS_INC(counter[COUNT_LEAVES]);
         const char *format_ok = ", total_value = %5.1f, total_weight = %5.1f\n";
         const char *format_ng = ", total_value = %5.1f, total_weight = %5.1f NG\n";
-        for (int i = 0; i < max_index; i++)
-        {
-            printf("%d", flags[i]);
-        }
+        if (!quiet)
+            for (int i = 0; i < max_index; i++)
+            {
+                printf("%d", flags[i]);
+            }
         if (sum_w < capacity)
         {
-            printf(format_ok, sum_v, sum_w);
+            STATS_INC(counter[COUNT_FEASIBLE]);
+            if (!quiet)
+                printf(format_ok, sum_v, sum_w);
             return sum_v;
         }
         else
         {
-            printf(format_ng, sum_v, sum_w);
+            if (!quiet)
+                printf(format_ng, sum_v, sum_w);
             return 0;
         }
     }
@@ -199,9 +319,312 @@ double search(int index, const Itemset *list, double capacity, unsigned char *fl
     flags[index] = 1;
     double v1;
     if (sum_w + list->item[index].weight > capacity)
+    {
+        STATS_INC(counter[COUNT_PRUNED]);
         v1 = 0;
+    }
     else
         v1 = search(index + 1, list, capacity, flags, sum_v + list->item[index].value, sum_w + list->item[index].weight);
 
     return (v0 > v1) ? v0 : v1;
 }
+
+// 0/1 knapsack DP over integral capacities. Weights are multiplied by scale
+// and must then be integers, which holds for the 0.1 steps init_itemset()
+// produces with the default scale of 10.
+Table *build_table(const Itemset *list, int scale)
+{
+    const int n = list->number;
+    int *weight = (int *)malloc(sizeof(int) * n);
+    long total = 0;
+    for (int i = 0; i < n; i++)
+    {
+        const double w = list->item[i].weight * scale;
+        weight[i] = (int)(w + 0.5);
+        if (w - weight[i] > 1.0E-6 || weight[i] - w > 1.0E-6)
+        {
+            fprintf(stderr, "weight %g of item %d is not a multiple of 1/%d.\n", list->item[i].weight, i, scale);
+            exit(1);
+        }
+        total += weight[i];
+    }
+    if (total > 100000000L)
+    {
+        fprintf(stderr, "total weight %ld is too large for the table.\n", total);
+        exit(1);
+    }
+
+    Table *table = (Table *)malloc(sizeof(Table));
+    table->scale = scale;
+    table->capacity = (int)total;
+    table->best = (double *)calloc(total + 1, sizeof(double));
+
+    STATS_TIMER_BEGIN(t_search);
+    double *best = table->best;
+    for (int i = 0; i < n; i++)
+    {
+        const double v = list->item[i].value;
+        for (int c = (int)total; c >= weight[i]; c--)
+        {
+            STATS_INC(counter[COUNT_CELLS]);
+            if (best[c - weight[i]] + v > best[c])
+                best[c] = best[c - weight[i]] + v;
+        }
+    }
+    STATS_TIMER_END(t_search, phase[PHASE_SEARCH]);
+    free(weight);
+    return table;
+}
+
+void free_table(Table *table)
+{
+    free(table->best);
+    free(table);
+}
+
+// Answers one capacity per input line with "capacity<TAB>value". A solution
+// may fill the capacity exactly.
+void run_queries(const Table *table, FILE *fp)
+{
+    char line[256];
+    STATS_TIMER_BEGIN(t_query);
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0')
+            continue;
+        const double capacity = load_double(line);
+        assert(capacity >= 0.0);
+
+        const double c = capacity * table->scale + 1.0E-6;
+        const int index = (c >= table->capacity) ? table->capacity : (int)c;
+        STATS_INC(counter[COUNT_QUERIES]);
+        printf("%s\t%.1f\n", line, table->best[index]);
+    }
+    fflush(stdout);
+    STATS_TIMER_END(t_query, phase[PHASE_QUERY]);
+}
+
+static const Item *sort_item;
+
+static int compare_ratio_desc(const void *p, const void *q)
+{
+    const Item *a = &sort_item[*(const int *)p];
+    const Item *b = &sort_item[*(const int *)q];
+    // a.v / a.w > b.v / b.w without dividing by a zero weight
+    const double lhs = a->value * b->weight;
+    const double rhs = b->value * a->weight;
+    return (lhs < rhs) - (lhs > rhs);
+}
+
+static int compare_scaled(const void *p, const void *q)
+{
+    const int *a = (const int *)p;
+    const int *b = (const int *)q;
+    if (a[0] != b[0])
+        return a[0] - b[0];
+    const double wa = sort_item[a[1]].weight;
+    const double wb = sort_item[b[1]].weight;
+    return (wa > wb) - (wa < wb);
+}
+
+#define TABLE_LIMIT ((size_t)1 << 30) // bytes of DP rows and decision table
+
+static void reject_epsilon(double epsilon, double bytes)
+{
+    fprintf(stderr, "epsilon = %g needs %.0f MiB of decision table; use a larger epsilon.\n", epsilon,
+            bytes / (1 << 20));
+    exit(1);
+}
+
+// Approximation scheme in the style of Ibarra and Kim. With LB the better of
+// the greedy prefix and the most valuable single item, OPT <= 2 LB. Items
+// worth more than T = (epsilon / 2) LB are "large": their values are scaled
+// down by K = (epsilon / 2) T and a DP over scaled value keeps the minimum
+// weight for every reachable total, in one rolling row. Each DP state is
+// completed with the greedy prefix of the small items, found by binary
+// search. Rounding loses less than K per large item and at most OPT / T of
+// them fit, so the loss is below (epsilon / 2) OPT; the small-item prefix
+// loses less than one small item, at most T <= (epsilon / 2) OPT. The result
+// is therefore within (1 - epsilon) of the optimum. bound receives the LP
+// relaxation bound.
+double fptas(const Itemset *list, double capacity, double epsilon, unsigned char *flags, double *bound)
+{
+    const int n = list->number;
+    const Item *item = list->item;
+    int *order = (int *)malloc(sizeof(int) * (n > 0 ? n : 1));
+    int m = 0;
+    for (int i = 0; i < n; i++)
+        if (item[i].weight <= capacity)
+            order[m++] = i;
+    sort_item = item;
+    qsort(order, m, sizeof(int), compare_ratio_desc);
+
+    // greedy prefix, LP bound and best single item
+    double prefix_v = 0.0, prefix_w = 0.0;
+    int k = 0;
+    while (k < m && prefix_w + item[order[k]].weight <= capacity)
+    {
+        prefix_v += item[order[k]].value;
+        prefix_w += item[order[k]].weight;
+        k++;
+    }
+    *bound = prefix_v;
+    if (k < m)
+        *bound += (capacity - prefix_w) * item[order[k]].value / item[order[k]].weight;
+    int single = -1;
+    for (int i = 0; i < m; i++)
+        if (single < 0 || item[order[i]].value > item[single].value)
+            single = order[i];
+
+    const double lower = (single >= 0 && item[single].value > prefix_v) ? item[single].value : prefix_v;
+    if (lower <= 0.0)
+    {
+        free(order);
+        return 0.0;
+    }
+
+    const double delta = epsilon / 2.0;
+    const double threshold = delta * lower;
+    const double unit = delta * threshold;
+    // two rows of doubles over the scaled values; checked before any of
+    // these counts is narrowed to an int
+    const double cells = *bound / unit + 1.0;
+    if (2.0 * sizeof(double) * (cells + 1.0) > (double)TABLE_LIMIT)
+        reject_epsilon(epsilon, 2.0 * sizeof(double) * (cells + 1.0));
+    const int top = (int)cells;
+
+    // split into small items (kept in ratio order, with prefix sums) and large
+    // ones; of the large items with the same scaled value q only the
+    // top / q lightest can ever be used together
+    int n_small = 0, n_large = 0;
+    int *small = (int *)malloc(sizeof(int) * (m + 1));
+    int *large = (int *)malloc(sizeof(int) * 2 * (m + 1));
+    for (int i = 0; i < m; i++)
+    {
+        const int j = order[i];
+        if (item[j].value <= threshold)
+            small[n_small++] = j;
+        else
+        {
+            const double q = item[j].value / unit; // below top, as value <= bound
+            large[2 * n_large] = (q < top) ? (int)q : top;
+            large[2 * n_large + 1] = j;
+            n_large++;
+        }
+    }
+    qsort(large, n_large, 2 * sizeof(int), compare_scaled);
+    int kept = 0;
+    for (int i = 0, run = 0; i < n_large; i++)
+    {
+        run = (i > 0 && large[2 * i] == large[2 * (i - 1)]) ? run + 1 : 0;
+        if (run < top / large[2 * i])
+        {
+            large[2 * kept] = large[2 * i];
+            large[2 * kept + 1] = large[2 * i + 1];
+            kept++;
+        }
+    }
+
+    double *small_w = (double *)malloc(sizeof(double) * (n_small + 1));
+    double *small_v = (double *)malloc(sizeof(double) * (n_small + 1));
+    small_w[0] = small_v[0] = 0.0;
+    for (int i = 0; i < n_small; i++)
+    {
+        small_w[i + 1] = small_w[i] + item[small[i]].weight;
+        small_v[i + 1] = small_v[i] + item[small[i]].value;
+    }
+
+    const size_t row = (size_t)top + 1;
+    const size_t bytes = ((size_t)kept * row + 7) / 8;
+    if (bytes > TABLE_LIMIT)
+        reject_epsilon(epsilon, (double)bytes);
+    unsigned char *choice = (unsigned char *)calloc(bytes > 0 ? bytes : 1, 1);
+    double *min_w = (double *)malloc(sizeof(double) * row);
+    double *val = (double *)malloc(sizeof(double) * row);
+    min_w[0] = 0.0;
+    val[0] = 0.0;
+    for (size_t p = 1; p < row; p++)
+        min_w[p] = capacity + 1.0;
+
+    int reach = 0;
+    for (int i = 0; i < kept; i++)
+    {
+        const int q = large[2 * i];
+        const Item *it = &item[large[2 * i + 1]];
+        reach = (reach + q < top) ? reach + q : top;
+        for (int p = reach; p >= q; p--)
+        {
+            STATS_INC(counter[COUNT_CELLS]);
+            const double w = min_w[p - q] + it->weight;
+            if (w < min_w[p] && w <= capacity)
+            {
+                min_w[p] = w;
+                val[p] = val[p - q] + it->value;
+                const size_t bit = (size_t)i * row + p;
+                choice[bit / 8] |= (unsigned char)(1 << (bit % 8));
+            }
+        }
+    }
+
+    // complete each state with the small-item prefix that fits
+    double best = -1.0;
+    int best_p = 0, best_k = 0;
+    for (int p = 0; p <= reach; p++)
+    {
+        if (min_w[p] > capacity)
+            continue;
+        const double left = capacity - min_w[p];
+        int lo = 0, hi = n_small;
+        while (lo < hi)
+        {
+            const int mid = (lo + hi + 1) / 2;
+            if (small_w[mid] <= left)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        if (val[p] + small_v[lo] > best)
+        {
+            best = val[p] + small_v[lo];
+            best_p = p;
+            best_k = lo;
+        }
+    }
+
+    if (best >= lower)
+    {
+        for (int i = kept - 1, p = best_p; i >= 0 && p > 0; i--)
+        {
+            const size_t bit = (size_t)i * row + p;
+            if (choice[bit / 8] & (1 << (bit % 8)))
+            {
+                flags[large[2 * i + 1]] = 1;
+                p -= large[2 * i];
+            }
+        }
+        for (int i = 0; i < best_k; i++)
+            flags[small[i]] = 1;
+    }
+    else if (single >= 0 && item[single].value > prefix_v)
+    {
+        best = item[single].value;
+        flags[single] = 1;
+    }
+    else
+    {
+        best = prefix_v;
+        for (int i = 0; i < k; i++)
+            flags[order[i]] = 1;
+    }
+
+    free(order);
+    free(small);
+    free(large);
+    free(small_w);
+    free(small_v);
+    free(choice);
+    free(min_w);
+    free(val);
+    return best;
+}
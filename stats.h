@@ -0,0 +1,67 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <time.h>
+
+// Phase timers and event counters shared by the solvers. Every probe
+// compiles to nothing when built with -DNO_STATS.
+
+typedef struct
+{
+    const char *name;
+    double seconds;
+} StatsPhase;
+
+typedef struct
+{
+    const char *name;
+    unsigned long long count;
+} StatsCounter;
+
+static inline double stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1.0E-9;
+}
+
+#ifndef NO_STATS
+#define STATS_ENABLED 1
+#define STATS_INC(counter) ((counter).count++)
+#define STATS_ADD(counter, n) ((counter).count += (n))
+#define STATS_TIMER_BEGIN(t) const double t = stats_now()
+#define STATS_TIMER_END(t, phase) ((phase).seconds += stats_now() - (t))
+#else
+#define STATS_ENABLED 0
+#define STATS_INC(counter) ((void)0)
+#define STATS_ADD(counter, n) ((void)0)
+#define STATS_TIMER_BEGIN(t) ((void)0)
+#define STATS_TIMER_END(t, phase) ((void)0)
+#endif
+
+// Adds the phase times and counts of src to dst.
+static inline void stats_merge(StatsPhase *dst_phase, const StatsPhase *src_phase, int n_phase,
+                               StatsCounter *dst_counter, const StatsCounter *src_counter, int n_counter)
+{
+    for (int i = 0; i < n_phase; i++)
+        dst_phase[i].seconds += src_phase[i].seconds;
+    for (int i = 0; i < n_counter; i++)
+        dst_counter[i].count += src_counter[i].count;
+}
+
+// Writes {"program": ..., "enabled": ..., "phases": {name: seconds},
+// "counters": {name: count}} on one line.
+static inline void stats_print_json(FILE *fp, const char *program, const StatsPhase *phase, int n_phase,
+                                    const StatsCounter *counter, int n_counter)
+{
+    fprintf(fp, "{\"program\": \"%s\", \"enabled\": %s, \"phases\": {", program, STATS_ENABLED ? "true" : "false");
+    for (int i = 0; i < n_phase; i++)
+        fprintf(fp, "%s\"%s\": %.9f", (i > 0) ? ", " : "", phase[i].name, phase[i].seconds);
+    fprintf(fp, "}, \"counters\": {");
+    for (int i = 0; i < n_counter; i++)
+        fprintf(fp, "%s\"%s\": %llu", (i > 0) ? ", " : "", counter[i].name, counter[i].count);
+    fprintf(fp, "}}\n");
+}
+
+#endif
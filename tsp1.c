@@ -6,6 +6,9 @@
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
+#include "stats.h"
+#include "fileio.h"
 
 typedef struct
 {
@@ -17,7 +20,11 @@ typedef struct
 {
     int width;
     int height;
-    char **dot;
+    char *frame;           // header line followed by the rows, written with a single fwrite
+    size_t frame_size;
+    char *dot;             // row-major: dot[y * (width + 1) + x], each row ends with '\n'
+    char *base;            // city labels only, same layout as dot
+    unsigned short *cover; // number of drawn route edges passing through each cell
 } Map;
 
 typedef struct
@@ -26,111 +33,685 @@ typedef struct
     double distance;
 } Answer;
 
+// Local search run on each restart: pairwise swaps of hillclimb(), 2-opt, or
+// Lin-Kernighan style variable-depth moves.
+typedef enum
+{
+    SEARCH_SWAP,
+    SEARCH_2OPT,
+    SEARCH_LK
+} LocalSearch;
+
 
-int max(const int a, const int b)
+#define NEIGHBOURS 10 // nearest cities listed per city
+
+// Buffers reused across restarts and, in batch mode, across instances.
+typedef struct
 {
-    return (a > b) ? a : b;
-}
+    int capacity;
+    City *city;
+    int *route; // route being climbed
+    int *trial; // best route of the current climb
+    int *best;  // best route over all restarts
+    int *pos;   // pos[c]: index of city c in the route being optimised
+    int *queue; // cities whose don't-look bit is off, as a ring buffer
+    unsigned char *active;
+    int head;
+    int count;
+    int *adj;           // edge recombination: up to 4 neighbours per city
+    unsigned char *deg; // number of entries left in adj, common edges flagged in common
+    unsigned char *common;
+    int *left;          // cities not yet in the child, with left_pos[c] its index
+    int *left_pos;
+    int *near;          // storage of the neighbour lists, NEIGHBOURS per city
+    unsigned char *near_ready;
+    int *succ;          // warm start: the route as a ring, -1 for cities not in it
+    int *pred;
+    int *rank;          // warm start: rank[c], place of c among the cities sorted by (x, y)
+} Workspace;
+
+// k nearest neighbours of each city, computed the first time they are asked for.
+typedef struct
+{
+    int n;
+    int k;
+    int *list; // list[c * k + i]: i-th nearest city to c
+    unsigned char *ready;
+    const int *order; // cities sorted by (x, y) with rank[c] the place of c,
+    const int *rank;  // or NULL: lists are then filled by a linear scan
+} Neighbours;
+
+// Population of the genetic solver. Each generation the workers breed
+// size offspring in parallel, each into its own slot of child. The workers
+// live for the whole run and meet the main thread at start and done before
+// and after each generation.
+typedef struct
+{
+    City *city;
+    int n;
+    int size;
+    int *tour;   // size tours of n cities
+    double *length;
+    int *child;  // size offspring
+    double *child_length;
+    int generation; // -1 tells the workers to exit
+    int threads;
+    unsigned int seed;
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+    Workspace *ws; // one per worker, kept across generations
+    Neighbours *nb;
+    LocalSearch search;
+    pthread_mutex_t lock;
+    StatsPhase *phase;
+    StatsCounter *counter;
+} Population;
 
-void draw_line(Map map, City a, City b);
+typedef struct
+{
+    Population *pop;
+    int id;
+} GeneticWorker;
+
+// Result line buffer; buffers move between the workers and the reorder
+// queue instead of being copied.
+typedef struct
+{
+    char *text;
+    size_t size;
+} Line;
+
+// Shared state of a batch run. Instances come either from a list of city
+// files or from one stream of concatenated city files; results are written
+// in input order.
+typedef struct
+{
+    pthread_mutex_t lock;
+    char **paths;  // NULL when reading from stream
+    int n_paths;
+    BlockReader *stream;
+    int next_job;
+    int done;      // no more instances
+    Line *pending; // pending[job].text is NULL until the job's line arrives
+    int n_pending;
+    int next_write;
+    Line *spare;   // written buffers, handed back to the workers
+    int n_spare;
+    int spare_capacity;
+    FILE *out;
+    int m;
+    LocalSearch search;
+    unsigned int seed;
+    StatsPhase *phase; // totals of the main thread, the workers add to them
+    StatsCounter *counter;
+} Batch;
+
+typedef struct
+{
+    FILE *fp;
+    Map map;
+    int *shown; // route currently drawn on the map
+    int drawn;  // whether shown holds a route yet
+    int *link;  // 4 n ints of successors and predecessors for plot_cities_update
+} Progress;
+
+void draw_line(Map map, City a, City b, int delta);
 void draw_route(Map map, City *city, int n, const int *route);
 void plot_cities(FILE *fp, Map map, City *city, int n, const int *route);
+void plot_cities_update(Progress *progress, City *city, int n, const int *route);
+void write_frame(FILE *fp, Map map);
 double distance(City a, City b);
 
 
+enum { PHASE_LOAD, PHASE_CONSTRUCT, PHASE_LOCAL_SEARCH, PHASE_OUTPUT, N_PHASE };
+enum { COUNT_RESTARTS, COUNT_MOVES, COUNT_IMPROVEMENTS, COUNT_FRAMES, COUNT_INSERTED, COUNT_REMOVED,
+       COUNT_GENERATIONS, COUNT_OFFSPRING, N_COUNTER };
+
+// thread-local so that batch workers can count without contention; each
+// worker adds its totals to the main thread's arrays when it finishes
+_Thread_local StatsPhase phase[N_PHASE] = {
+    [PHASE_LOAD] = {"load"},
+    [PHASE_CONSTRUCT] = {"construct"},
+    [PHASE_LOCAL_SEARCH] = {"local_search"},
+    [PHASE_OUTPUT] = {"output"},
+};
+_Thread_local StatsCounter counter[N_COUNTER] = {
+    [COUNT_RESTARTS] = {"restarts"},
+    [COUNT_MOVES] = {"moves_evaluated"},
+    [COUNT_IMPROVEMENTS] = {"improvements"},
+    [COUNT_FRAMES] = {"frames"},
+    [COUNT_INSERTED] = {"inserted"},
+    [COUNT_REMOVED] = {"removed"},
+    [COUNT_GENERATIONS] = {"generations"},
+    [COUNT_OFFSPRING] = {"offspring"},
+};
+
 Map init_map(const int width, const int height);
 void free_map_dot(Map m);
-City *load_cities(const char *filename, int *n);
+int read_cities(BlockReader *r, Workspace *ws);
+void load_cities(const char *filename, Workspace *ws, int *n);
+
+void init_workspace(Workspace *ws);
+void reserve_workspace(Workspace *ws, int n);
+void free_workspace(Workspace *ws);
 
-Answer solve(City *city, int n, int m, int *route);
+Answer solve(City *city, int n, int m, LocalSearch search, Workspace *ws, unsigned int *seed, Progress *progress);
 double total_distance(City *city, int *route, int n);
-Answer hillclimb(City *city, int n, int *route);
-void init_random_route(int *route, int n);
+Answer hillclimb(City *city, int n, int *route, int *best);
+void init_random_route(int *route, int n, unsigned int *seed);
 void copy_list(int *list1, int *list2, int n);
+void rotate_to_zero(int *route, int n, int *tmp);
+
+void init_neighbours(Neighbours *nb, Workspace *ws, int n);
+const int *neighbours_of(Neighbours *nb, City *city, int c);
+void activate(Workspace *ws, int n, int c);
+void reverse_segment(int *route, int *pos, int n, int i, int j);
+double two_opt(City *city, int n, int *route, Workspace *ws, Neighbours *nb);
+double lin_kernighan(City *city, int n, int *route, Workspace *ws, Neighbours *nb);
+
+City *load_tour(const char *filename, int *n);
+void save_tour(const char *filename, City *city, const int *route, int n);
+Answer warm_start(City *city, int n, const City *prev, int n_prev, LocalSearch search, Workspace *ws);
+
+void nearest_neighbour_route(City *city, int n, int *route, Workspace *ws, Neighbours *nb, unsigned int *seed);
+double optimise_route(City *city, int n, int *route, LocalSearch search, Workspace *ws, Neighbours *nb);
+void edge_recombination(City *city, int n, const int *p1, const int *p2, int *child, Workspace *ws,
+                        Neighbours *nb, unsigned int *seed);
+Answer genetic(City *city, int n, int size, int generations, int threads, unsigned int seed,
+               LocalSearch search, Workspace *ws, Progress *progress);
+void *genetic_worker(void *arg);
+
+void run_batch(Batch *batch, int threads);
+void *batch_worker(void *arg);
+int next_instance(Batch *batch, Workspace *ws, int *n, char *name, size_t name_size);
+void write_result(Batch *batch, int job, Line *line);
 
 Map init_map(const int width, const int height)
 {
-    char **dot = (char **)malloc(width * sizeof(char *));
-    char *tmp = (char *)malloc(width * height * sizeof(char));
-    for (int i = 0; i < width; i++)
-        dot[i] = tmp + i * height;
-    return (Map){.width = width, .height = height, .dot = dot};
+    const char *header = "----------\n";
+    const size_t header_size = strlen(header);
+    const size_t cells = (size_t)(width + 1) * height;
+
+    char *frame = (char *)malloc(header_size + cells);
+    char *base = (char *)malloc(cells);
+    unsigned short *cover = (unsigned short *)calloc(cells, sizeof(unsigned short));
+    memcpy(frame, header, header_size);
+    return (Map){.width = width, .height = height, .frame = frame, .frame_size = header_size + cells,
+                 .dot = frame + header_size, .base = base, .cover = cover};
 }
 
 void free_map_dot(Map m)
 {
-    free(m.dot[0]);
-    free(m.dot);
+    free(m.frame);
+    free(m.base);
+    free(m.cover);
 }
 
-City *load_cities(const char *filename, int *n)
+void init_workspace(Workspace *ws)
 {
-    City *city;
-    FILE *fp;
-    if ((fp = fopen(filename, "rb")) == NULL)
+    *ws = (Workspace){.capacity = 0, .city = NULL, .route = NULL, .trial = NULL, .best = NULL,
+                      .pos = NULL, .queue = NULL, .active = NULL, .head = 0, .count = 0,
+                      .adj = NULL, .deg = NULL, .common = NULL, .left = NULL, .left_pos = NULL,
+                      .near = NULL, .near_ready = NULL, .succ = NULL, .pred = NULL, .rank = NULL};
+}
+
+void reserve_workspace(Workspace *ws, int n)
+{
+    if (n <= ws->capacity)
+        return;
+    ws->city = (City *)realloc(ws->city, sizeof(City) * n);
+    ws->route = (int *)realloc(ws->route, sizeof(int) * n);
+    ws->trial = (int *)realloc(ws->trial, sizeof(int) * n);
+    ws->best = (int *)realloc(ws->best, sizeof(int) * n);
+    ws->pos = (int *)realloc(ws->pos, sizeof(int) * n);
+    ws->queue = (int *)realloc(ws->queue, sizeof(int) * n);
+    ws->active = (unsigned char *)realloc(ws->active, sizeof(unsigned char) * n);
+    ws->adj = (int *)realloc(ws->adj, sizeof(int) * 4 * n);
+    ws->deg = (unsigned char *)realloc(ws->deg, sizeof(unsigned char) * n);
+    ws->common = (unsigned char *)realloc(ws->common, sizeof(unsigned char) * 4 * n);
+    ws->left = (int *)realloc(ws->left, sizeof(int) * n);
+    ws->left_pos = (int *)realloc(ws->left_pos, sizeof(int) * n);
+    ws->near = (int *)realloc(ws->near, sizeof(int) * NEIGHBOURS * n);
+    ws->near_ready = (unsigned char *)realloc(ws->near_ready, sizeof(unsigned char) * n);
+    ws->succ = (int *)realloc(ws->succ, sizeof(int) * n);
+    ws->pred = (int *)realloc(ws->pred, sizeof(int) * n);
+    ws->rank = (int *)realloc(ws->rank, sizeof(int) * n);
+    ws->capacity = n;
+}
+
+void free_workspace(Workspace *ws)
+{
+    free(ws->city);
+    free(ws->route);
+    free(ws->trial);
+    free(ws->best);
+    free(ws->pos);
+    free(ws->queue);
+    free(ws->active);
+    free(ws->adj);
+    free(ws->deg);
+    free(ws->common);
+    free(ws->left);
+    free(ws->left_pos);
+    free(ws->near);
+    free(ws->near_ready);
+    free(ws->succ);
+    free(ws->pred);
+    free(ws->rank);
+    init_workspace(ws);
+}
+
+// Reads one city file image (int n, then n pairs of int) into ws->city.
+// Returns n, or 0 at the end of the stream.
+int read_cities(BlockReader *r, Workspace *ws)
+{
+    const int n = read_count(r);
+    if (n < 0)
+        return 0;
+    if (n == 0)
     {
-        fprintf(stderr, "%s: cannot open file.\n", filename);
+        fprintf(stderr, "%s: invalid number of cities: %d\n", r->filename, n);
         exit(1);
     }
-    fread(n, sizeof(int), 1, fp);
-    city = (City *)malloc(sizeof(City) * *n);
-    for (int i = 0; i < *n; i++)
+    reserve_workspace(ws, n);
+    read_records(r, ws->city, sizeof(City), n); // City has the layout of CityRecord
+    return n;
+}
+
+void load_cities(const char *filename, Workspace *ws, int *n)
+{
+    BlockReader *r = open_reader(filename);
+    *n = read_cities(r, ws);
+    if (*n == 0)
     {
-        fread(&city[i].x, sizeof(int), 1, fp);
-        fread(&city[i].y, sizeof(int), 1, fp);
+        fprintf(stderr, "%s: empty city file.\n", filename);
+        exit(1);
     }
-    fclose(fp);
-    return city;
+    close_reader(r);
 }
 
 int main(int argc, char **argv)
 {
     const int width = 70;
     const int height = 40;
-    const int max_cities = 100;
-    Map map = init_map(width, height);
+    const int max_cities = 100000; // the map clips what does not fit
 
     FILE *fp = stdout;
-    if (argc != 3)
+    char *args[argc];
+    int nargs = 0;
+    int show_progress = 0;
+    int show_stats = 0;
+    unsigned int seed = (unsigned int)time(NULL);
+    const char *batch_list = NULL;
+    const char *batch_stream = NULL;
+    const char *output = NULL;
+    const char *warm_tour = NULL;
+    const char *save_file = NULL;
+    int use_genetic = 0;
+    int search = -1; // default: swaps for restarts, 2-opt otherwise
+    int population = 30;
+    int generations = 50;
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < argc; i++)
     {
-        fprintf(stderr, "Usage: %s <city file><number of random solutions>\n", argv[0]);
+        if (strcmp(argv[i], "--progress") == 0)
+            show_progress = 1;
+        else if (strncmp(argv[i], "--seed=", 7) == 0)
+            seed = (unsigned int)atoi(argv[i] + 7);
+        else if (strcmp(argv[i], "--stats=json") == 0)
+            show_stats = 1;
+        else if (strncmp(argv[i], "--batch=", 8) == 0)
+            batch_list = argv[i] + 8;
+        else if (strncmp(argv[i], "--batch-stream=", 15) == 0)
+            batch_stream = argv[i] + 15;
+        else if (strncmp(argv[i], "--threads=", 10) == 0)
+            threads = atoi(argv[i] + 10);
+        else if (strncmp(argv[i], "--output=", 9) == 0)
+            output = argv[i] + 9;
+        else if (strncmp(argv[i], "--warm-start=", 13) == 0)
+            warm_tour = argv[i] + 13;
+        else if (strncmp(argv[i], "--save-tour=", 12) == 0)
+            save_file = argv[i] + 12;
+        else if (strcmp(argv[i], "--genetic") == 0)
+            use_genetic = 1;
+        else if (strcmp(argv[i], "--local-search=swap") == 0)
+            search = SEARCH_SWAP;
+        else if (strcmp(argv[i], "--local-search=2opt") == 0)
+            search = SEARCH_2OPT;
+        else if (strcmp(argv[i], "--local-search=lk") == 0)
+            search = SEARCH_LK;
+        else if (strncmp(argv[i], "--population=", 13) == 0)
+            population = atoi(argv[i] + 13);
+        else if (strncmp(argv[i], "--generations=", 14) == 0)
+            generations = atoi(argv[i] + 14);
+        else if (strncmp(argv[i], "--", 2) == 0)
+        {
+            fprintf(stderr, "%s: unknown option.\n", argv[i]);
+            exit(1);
+        }
+        else
+            args[nargs++] = argv[i];
+    }
+
+    if (batch_list != NULL || batch_stream != NULL)
+    {
+        if (nargs != 1 || (batch_list != NULL && batch_stream != NULL) || show_progress)
+        {
+            fprintf(stderr, "Usage: %s (--batch=<list file> | --batch-stream=<city stream>) [--threads=N] [--output=<file>] [--local-search=swap|2opt|lk] [--seed=N] [--stats=json] <number of random solutions>\n", argv[0]);
+            exit(1);
+        }
+        if (threads < 1)
+            threads = 1;
+
+        Batch batch = {.paths = NULL, .n_paths = 0, .stream = NULL, .next_job = 0, .done = 0,
+                       .pending = NULL, .n_pending = 0, .next_write = 0,
+                       .spare = NULL, .n_spare = 0, .spare_capacity = 0, .out = stdout,
+                       .m = atoi(args[0]), .search = (search < 0) ? SEARCH_SWAP : search, .seed = seed,
+                       .phase = phase, .counter = counter};
+        assert(batch.m > 0);
+        pthread_mutex_init(&batch.lock, NULL);
+
+        if (batch_list != NULL)
+        {
+            FILE *in;
+            if ((in = fopen(batch_list, "r")) == NULL)
+            {
+                fprintf(stderr, "%s: cannot open file.\n", batch_list);
+                exit(1);
+            }
+            char line[4096];
+            int capacity = 0;
+            while (fgets(line, sizeof(line), in) != NULL)
+            {
+                line[strcspn(line, "\r\n")] = '\0';
+                if (line[0] == '\0')
+                    continue;
+                if (batch.n_paths == capacity)
+                {
+                    capacity = (capacity > 0) ? 2 * capacity : 64;
+                    batch.paths = (char **)realloc(batch.paths, sizeof(char *) * capacity);
+                }
+                batch.paths[batch.n_paths++] = strdup(line);
+            }
+            fclose(in);
+        }
+        else
+            batch.stream = open_reader(batch_stream);
+
+        if (output != NULL && (batch.out = fopen(output, "w")) == NULL)
+        {
+            fprintf(stderr, "%s: cannot open file.\n", output);
+            exit(1);
+        }
+
+        run_batch(&batch, threads);
+
+        if (batch.out != stdout)
+            fclose(batch.out);
+        if (batch.stream != NULL)
+            close_reader(batch.stream);
+        for (int i = 0; i < batch.n_paths; i++)
+            free(batch.paths[i]);
+        free(batch.paths);
+        free(batch.pending);
+        for (int i = 0; i < batch.n_spare; i++)
+            free(batch.spare[i].text);
+        free(batch.spare);
+        pthread_mutex_destroy(&batch.lock);
+
+        if (show_stats)
+            stats_print_json(stderr, "tsp1", phase, N_PHASE, counter, N_COUNTER);
+        return 0;
+    }
+
+    const int restarts = (warm_tour == NULL && !use_genetic);
+    if (nargs != (restarts ? 2 : 1) || (warm_tour != NULL && use_genetic) || (!restarts && search == SEARCH_SWAP))
+    {
+        fprintf(stderr, "Usage: %s [--progress] [--local-search=swap|2opt|lk] [--seed=N] [--stats=json] [--save-tour=<tour file>] <city file><number of random solutions>\n"
+                        "       %s --warm-start=<tour file> [--local-search=2opt|lk] [--stats=json] [--save-tour=<tour file>] <city file>\n"
+                        "       %s --genetic [--population=P] [--generations=G] [--threads=N] [--local-search=2opt|lk] [--progress] [--seed=N] [--stats=json] [--save-tour=<tour file>] <city file>\n",
+                argv[0], argv[0], argv[0]);
         exit(1);
     }
 
+    if (search < 0)
+        search = restarts ? SEARCH_SWAP : SEARCH_2OPT;
+
+    Map map = init_map(width, height);
+    Workspace ws;
+    init_workspace(&ws);
+
     int n;
-    City *city = load_cities(argv[1], &n);
+    STATS_TIMER_BEGIN(t_load);
+    load_cities(args[0], &ws, &n);
+    STATS_TIMER_END(t_load, phase[PHASE_LOAD]);
     assert(n > 1 && n <= max_cities);
+    City *city = ws.city;
 
-    const int random_route_number = atoi(argv[2]);
-    assert(random_route_number > 0);
-
+    STATS_TIMER_BEGIN(t_plot);
     plot_cities(fp, map, city, n, NULL);
+    STATS_TIMER_END(t_plot, phase[PHASE_OUTPUT]);
 
-    int route[n];
+    Progress progress = {.fp = fp, .map = map, .shown = (int *)malloc(sizeof(int) * n), .drawn = 0,
+                         .link = (int *)malloc(sizeof(int) * 4 * n)};
+    Answer ans;
+    if (warm_tour != NULL)
+    {
+        int n_prev;
+        STATS_TIMER_BEGIN(t_tour);
+        City *prev = load_tour(warm_tour, &n_prev);
+        STATS_TIMER_END(t_tour, phase[PHASE_LOAD]);
+        ans = warm_start(city, n, prev, n_prev, search, &ws);
+        free(prev);
+    }
+    else if (use_genetic)
+    {
+        assert(population > 1 && generations >= 0);
+        ans = genetic(city, n, population, generations, (threads > 0) ? threads : 1, seed, search, &ws,
+                      show_progress ? &progress : NULL);
+    }
+    else
+    {
+        const int random_route_number = atoi(args[1]);
+        assert(random_route_number > 0);
+        ans = solve(city, n, random_route_number, search, &ws, &seed, show_progress ? &progress : NULL);
+    }
 
-    Answer ans = solve(city, n, random_route_number, route);
-    plot_cities(fp, map, city, n, ans.route);
+    STATS_TIMER_BEGIN(t_output);
+    if (progress.drawn)
+        plot_cities_update(&progress, city, n, ans.route);
+    else
+        plot_cities(fp, map, city, n, ans.route);
     printf("total distance = %f\n", ans.distance);
     for (int i = 0; i < n; i++)
     {
         printf("%d -> ", ans.route[i]);
     }
     printf("0\n");
+    fflush(fp);
+    if (save_file != NULL)
+        save_tour(save_file, city, ans.route, n);
+    STATS_TIMER_END(t_output, phase[PHASE_OUTPUT]);
+
+    if (show_stats)
+        stats_print_json(stderr, "tsp1", phase, N_PHASE, counter, N_COUNTER);
 
-    free(city);
+    free(progress.shown);
+    free(progress.link);
+    free_workspace(&ws);
+    free_map_dot(map);
 
     return 0;
 }
 
-void draw_line(Map map, City a, City b)
+void run_batch(Batch *batch, int threads)
+{
+    pthread_t tid[threads];
+    for (int i = 0; i < threads; i++)
+        pthread_create(&tid[i], NULL, batch_worker, batch);
+    for (int i = 0; i < threads; i++)
+        pthread_join(tid[i], NULL);
+}
+
+// Hands out the next instance, loaded into the worker's workspace. Returns
+// the job number, or -1 when the input is exhausted.
+int next_instance(Batch *batch, Workspace *ws, int *n, char *name, size_t name_size)
+{
+    int job = -1;
+    pthread_mutex_lock(&batch->lock);
+    if (!batch->done)
+    {
+        if (batch->paths != NULL)
+        {
+            if (batch->next_job < batch->n_paths)
+                job = batch->next_job++;
+            else
+                batch->done = 1;
+        }
+        else if ((*n = read_cities(batch->stream, ws)) > 0)
+        {
+            job = batch->next_job++;
+            snprintf(name, name_size, "#%d", job);
+        }
+        else
+            batch->done = 1;
+    }
+    if (job >= 0 && job >= batch->n_pending)
+    {
+        int capacity = (batch->n_pending > 0) ? 2 * batch->n_pending : 64;
+        while (capacity <= job)
+            capacity *= 2;
+        batch->pending = (Line *)realloc(batch->pending, sizeof(Line) * capacity);
+        memset(batch->pending + batch->n_pending, 0, sizeof(Line) * (capacity - batch->n_pending));
+        batch->n_pending = capacity;
+    }
+    pthread_mutex_unlock(&batch->lock);
+
+    // files from a list are read outside the lock
+    if (job >= 0 && batch->paths != NULL)
+    {
+        load_cities(batch->paths[job], ws, n);
+        snprintf(name, name_size, "%s", batch->paths[job]);
+    }
+    return job;
+}
+
+// Queues the result line of a job and writes every line that is now in order.
+// The queue takes the buffer of line, and line gets a written one back, so
+// once every buffer has grown to its largest line nothing is allocated.
+void write_result(Batch *batch, int job, Line *line)
 {
-    const int n = max(abs(a.x - b.x), abs(a.y - b.y));
-    for (int i = 1; i <= n; i++)
+    pthread_mutex_lock(&batch->lock);
+    batch->pending[job] = *line;
+    *line = (batch->n_spare > 0) ? batch->spare[--batch->n_spare] : (Line){.text = NULL, .size = 0};
+    while (batch->next_write < batch->n_pending && batch->pending[batch->next_write].text != NULL)
     {
-        const int x = a.x + i * (b.x - a.x) / n;
-        const int y = a.y + i * (b.y - a.y) / n;
-        if (map.dot[x][y] == ' ')
-            map.dot[x][y] = '*';
+        Line *done = &batch->pending[batch->next_write];
+        fputs(done->text, batch->out);
+        if (batch->n_spare == batch->spare_capacity)
+        {
+            batch->spare_capacity = (batch->spare_capacity > 0) ? 2 * batch->spare_capacity : 16;
+            batch->spare = (Line *)realloc(batch->spare, sizeof(Line) * batch->spare_capacity);
+        }
+        batch->spare[batch->n_spare++] = *done;
+        done->text = NULL;
+        batch->next_write++;
+    }
+    pthread_mutex_unlock(&batch->lock);
+}
+
+void *batch_worker(void *arg)
+{
+    Batch *batch = (Batch *)arg;
+    Workspace ws;
+    init_workspace(&ws);
+    char name[4096];
+    Line line = {.text = NULL, .size = 0};
+    int n;
+    int job;
+
+    for (;;)
+    {
+        STATS_TIMER_BEGIN(t_load);
+        job = next_instance(batch, &ws, &n, name, sizeof(name));
+        STATS_TIMER_END(t_load, phase[PHASE_LOAD]);
+        if (job < 0)
+            break;
+        if (n < 2)
+        {
+            fprintf(stderr, "%s: at least two cities are needed.\n", name);
+            exit(1);
+        }
+
+        // the seed depends only on the job, so results do not depend on scheduling
+        unsigned int seed = batch->seed + (unsigned int)job;
+        Answer ans = solve(ws.city, n, batch->m, batch->search, &ws, &seed, NULL);
+
+        STATS_TIMER_BEGIN(t_output);
+        const size_t need = strlen(name) + 64 + (size_t)n * 12;
+        if (need > line.size)
+        {
+            line.size = need;
+            line.text = (char *)realloc(line.text, line.size);
+        }
+        int len = sprintf(line.text, "%s\t%d\t%f\t", name, n, ans.distance);
+        for (int i = 0; i < n; i++)
+            len += sprintf(line.text + len, (i > 0) ? " %d" : "%d", ans.route[i]);
+        sprintf(line.text + len, "\n");
+        write_result(batch, job, &line);
+        STATS_TIMER_END(t_output, phase[PHASE_OUTPUT]);
+    }
+
+    free(line.text);
+    free_workspace(&ws);
+
+    pthread_mutex_lock(&batch->lock);
+    stats_merge(batch->phase, phase, N_PHASE, batch->counter, counter, N_COUNTER);
+    pthread_mutex_unlock(&batch->lock);
+    return NULL;
+}
+
+// Bresenham walk between a and b. delta = +1 draws the segment, delta = -1
+// erases it; a cell falls back to its label or a blank once no drawn edge
+// covers it. The end points are ordered so that an edge always covers the
+// same cells whichever way round the route traverses it.
+void draw_line(Map map, City a, City b, int delta)
+{
+    if (a.x > b.x || (a.x == b.x && a.y > b.y))
+    {
+        const City t = a;
+        a = b;
+        b = t;
+    }
+    const int dx = abs(b.x - a.x);
+    const int dy = -abs(b.y - a.y);
+    const int sx = (a.x < b.x) ? 1 : -1;
+    const int sy = (a.y < b.y) ? 1 : -1;
+    const int stride = map.width + 1;
+    int err = dx + dy;
+    int x = a.x;
+    int y = a.y;
+
+    while (x != b.x || y != b.y)
+    {
+        const int e2 = 2 * err;
+        if (e2 >= dy)
+        {
+            err += dy;
+            x += sx;
+        }
+        if (e2 <= dx)
+        {
+            err += dx;
+            y += sy;
+        }
+        if (x < 0 || x >= map.width || y < 0 || y >= map.height)
+            continue;
+
+        const int k = y * stride + x;
+        map.cover[k] += delta;
+        if (map.base[k] == ' ')
+            map.dot[k] = (map.cover[k] > 0) ? '*' : ' ';
     }
 }
 
@@ -143,40 +724,97 @@ void draw_route(Map map, City *city, int n, const int *route)
     {
         const int c0 = route[i];
         const int c1 = route[(i + 1) % n];
-        draw_line(map, city[c0], city[c1]);
+        draw_line(map, city[c0], city[c1], 1);
     }
 }
 
+void write_frame(FILE *fp, Map map)
+{
+    STATS_INC(counter[COUNT_FRAMES]);
+    fwrite(map.frame, sizeof(char), map.frame_size, fp);
+    fflush(fp);
+}
+
 void plot_cities(FILE *fp, Map map, City *city, int n, const int *route)
 {
-    fprintf(fp, "----------\n");
+    const int stride = map.width + 1;
+    const size_t cells = (size_t)stride * map.height;
 
-    memset(map.dot[0], ' ', map.width * map.height);
+    memset(map.base, ' ', cells);
+    memset(map.cover, 0, cells * sizeof(unsigned short));
+    for (int y = 0; y < map.height; y++)
+        map.base[y * stride + map.width] = '\n';
 
     for (int i = 0; i < n; i++)
     {
         char buf[100];
-        sprintf(buf, "C_%d", i);
-        for (int j = 0; j < strlen(buf); j++)
+        const int len = sprintf(buf, "C_%d", i);
+        const int y = city[i].y;
+        if (y < 0 || y >= map.height)
+            continue;
+        for (int j = 0; j < len; j++)
         {
             const int x = city[i].x + j;
-            const int y = city[i].y;
-            map.dot[x][y] = buf[j];
+            if (x >= 0 && x < map.width)
+                map.base[y * stride + x] = buf[j];
         }
     }
+    memcpy(map.dot, map.base, cells);
 
     draw_route(map, city, n, route);
+    write_frame(fp, map);
+}
 
-    for (int y = 0; y < map.height; y++)
+// Redraw only the edges that differ between the route currently on the map
+// (progress->shown, if drawn) and route, then emit the frame. route becomes
+// the shown one.
+void plot_cities_update(Progress *progress, City *city, int n, const int *route)
+{
+    FILE *fp = progress->fp;
+    const Map map = progress->map;
+    const int *prev = progress->shown;
+    int *prev_next = progress->link;
+    int *prev_back = prev_next + n;
+    int *next = prev_back + n;
+    int *back = next + n;
+
+    if (!progress->drawn)
     {
-        for (int x = 0; x < map.width; x++)
-        {
-            const char c = map.dot[x][y];
-            fputc(c, fp);
-        }
-        fputc('\n', fp);
+        draw_route(map, city, n, route);
+        write_frame(fp, map);
+        memcpy(progress->shown, route, sizeof(int) * n);
+        progress->drawn = 1;
+        return;
     }
-    fflush(fp);
+
+    for (int i = 0; i < n; i++)
+    {
+        next[route[i]] = route[(i + 1) % n];
+        back[route[(i + 1) % n]] = route[i];
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        prev_next[prev[i]] = prev[(i + 1) % n];
+        prev_back[prev[(i + 1) % n]] = prev[i];
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        const int a = prev[i];
+        const int b = prev_next[a];
+        if (next[a] != b && back[a] != b)
+            draw_line(map, city[a], city[b], -1);
+    }
+    for (int i = 0; i < n; i++)
+    {
+        const int a = route[i];
+        const int b = next[a];
+        if (prev_next[a] != b && prev_back[a] != b)
+            draw_line(map, city[a], city[b], 1);
+    }
+    write_frame(fp, map);
+    memcpy(progress->shown, route, sizeof(int) * n);
 }
 
 double distance(City a, City b)
@@ -186,23 +824,50 @@ double distance(City a, City b)
     return sqrt(dx * dx + dy * dy);
 }
 
-Answer solve(City *city, int n, int m, int *route)
+// Runs m random restarts with the buffers of ws; the returned route is ws->best.
+Answer solve(City *city, int n, int m, LocalSearch search, Workspace *ws, unsigned int *seed, Progress *progress)
 {
-    srand(time(NULL));
-    Answer ans_dis = {.distance = 1.0E10, .route = NULL};
+    Answer ans_dis = {.distance = 1.0E10, .route = ws->best};
     Answer pos_dis = {.distance = 1.0E10, .route = NULL};
+    Neighbours nb;
 
+    reserve_workspace(ws, n);
+    if (search != SEARCH_SWAP)
+        init_neighbours(&nb, ws, n);
     for (int i=0; i<m; ++i)
     {
-        init_random_route(route, n);
-        pos_dis = hillclimb(city, n, route);
+        STATS_INC(counter[COUNT_RESTARTS]);
+        STATS_TIMER_BEGIN(t_construct);
+        if (search == SEARCH_SWAP)
+            init_random_route(ws->route, n, seed);
+        else
+            nearest_neighbour_route(city, n, ws->trial, ws, &nb, seed);
+        STATS_TIMER_END(t_construct, phase[PHASE_CONSTRUCT]);
+
+        STATS_TIMER_BEGIN(t_search);
+        if (search == SEARCH_SWAP)
+            pos_dis = hillclimb(city, n, ws->route, ws->trial);
+        else
+            pos_dis = (Answer){.route = ws->trial, .distance = optimise_route(city, n, ws->trial, search, ws, &nb)};
+        STATS_TIMER_END(t_search, phase[PHASE_LOCAL_SEARCH]);
         if (pos_dis.distance < ans_dis.distance)
-            ans_dis = pos_dis;
+        {
+            ans_dis.distance = pos_dis.distance;
+            copy_list(ws->best, ws->trial, n);
+            if (progress != NULL)
+            {
+                STATS_TIMER_BEGIN(t_plot);
+                plot_cities_update(progress, city, n, ans_dis.route);
+                STATS_TIMER_END(t_plot, phase[PHASE_OUTPUT]);
+            }
+        }
     }
+    if (search != SEARCH_SWAP)
+        rotate_to_zero(ans_dis.route, n, ws->trial);
     return ans_dis;
 }
 
-void init_random_route(int *route, int n)
+void init_random_route(int *route, int n, unsigned int *seed)
 {
     int count = 1;
     int random;
@@ -210,7 +875,7 @@ void init_random_route(int *route, int n)
     while (count < n)
     {
         label :
-        random = rand() % n;
+        random = rand_r(seed) % n;
         for (int i=0; i<count; ++i)
             if (random == route[i])
                 goto label;
@@ -225,6 +890,18 @@ void copy_list(int *list1, int *list2, int n)
         list1[i] = list2[i];
 }
 
+// Rotates the route to start at city 0, as hillclimb() leaves its routes;
+// tmp holds n ints.
+void rotate_to_zero(int *route, int n, int *tmp)
+{
+    int shift = 0;
+    while (route[shift] != 0)
+        shift++;
+    for (int i = 0; i < n; i++)
+        tmp[i] = route[(i + shift) % n];
+    copy_list(route, tmp, n);
+}
+
 double total_distance(City *city, int *route, int n)
 {
     double total = 0.0;
@@ -236,26 +913,941 @@ double total_distance(City *city, int *route, int n)
     return total;
 }
 
-Answer hillclimb(City *city, int n, int *route)
+// Climbs from route, recording the best route seen in best.
+Answer hillclimb(City *city, int n, int *route, int *best)
 {
     double distance = total_distance(city, route, n);
-    Answer *ans = malloc(sizeof(int) * n + sizeof(double));
+    Answer ans = {.distance = distance, .route = best};
     int temp;
-    ans->distance = 1.0E5;
-    ans->route = (int *)malloc(sizeof(int) * n);
+    copy_list(best, route, n);
     for (int i=1; i<n-1; ++i)
         for (int j=i+1; j<n; ++j)
         {
             temp = route[i];
             route[i] = route[j];
             route[j] = temp;
+            STATS_INC(counter[COUNT_MOVES]);
             distance = total_distance(city, route, n);
-            if (distance < ans->distance)
+            if (distance < ans.distance)
+            {
+                STATS_INC(counter[COUNT_IMPROVEMENTS]);
+                ans.distance = distance;
+                copy_list(best, route, n);
+            }
+        }
+
+    return ans;
+}
+
+// Empty neighbour lists for n cities, kept in ws (reserved for n cities).
+void init_neighbours(Neighbours *nb, Workspace *ws, int n)
+{
+    nb->n = n;
+    nb->k = (NEIGHBOURS < n - 1) ? NEIGHBOURS : n - 1;
+    nb->list = ws->near;
+    nb->ready = ws->near_ready;
+    nb->order = NULL;
+    nb->rank = NULL;
+    memset(nb->ready, 0, n);
+}
+
+// Adds city j at distance dj to the *found nearest cities in list and d,
+// which stay ordered by distance and then by index, if it is among the k
+// nearest.
+static void keep_nearest(int *list, double *d, int *found, int k, int j, double dj)
+{
+    if (*found == k && (dj > d[k - 1] || (dj == d[k - 1] && j > list[k - 1])))
+        return;
+    int i = (*found < k) ? (*found)++ : k - 1;
+    while (i > 0 && (d[i - 1] > dj || (d[i - 1] == dj && list[i - 1] > j)))
+    {
+        d[i] = d[i - 1];
+        list[i] = list[i - 1];
+        i--;
+    }
+    d[i] = dj;
+    list[i] = j;
+}
+
+// Nearest neighbours of c, closest first. Filled on first use, so a search
+// that touches few cities does not pay for the whole instance. With a sorted
+// index the scan walks outwards from c and stops once the x gap alone exceeds
+// the k-th distance; the lists are the same either way.
+const int *neighbours_of(Neighbours *nb, City *city, int c)
+{
+    int *list = nb->list + (size_t)c * nb->k;
+    if (nb->ready[c])
+        return list;
+
+    double d[nb->k];
+    int found = 0;
+    if (nb->order == NULL)
+    {
+        for (int j = 0; j < nb->n; j++)
+            if (j != c)
+                keep_nearest(list, d, &found, nb->k, j, distance(city[c], city[j]));
+    }
+    else
+    {
+        const int r = nb->rank[c];
+        for (int i = r - 1; i >= 0; i--)
+        {
+            const int j = nb->order[i];
+            if (found == nb->k && city[c].x - city[j].x > d[found - 1])
+                break;
+            keep_nearest(list, d, &found, nb->k, j, distance(city[c], city[j]));
+        }
+        for (int i = r + 1; i < nb->n; i++)
+        {
+            const int j = nb->order[i];
+            if (found == nb->k && city[j].x - city[c].x > d[found - 1])
+                break;
+            keep_nearest(list, d, &found, nb->k, j, distance(city[c], city[j]));
+        }
+    }
+    nb->ready[c] = 1;
+    return list;
+}
+
+// Clears the don't-look bit of c and queues it.
+void activate(Workspace *ws, int n, int c)
+{
+    if (ws->active[c])
+        return;
+    ws->active[c] = 1;
+    ws->queue[(ws->head + ws->count) % n] = c;
+    ws->count++;
+}
+
+// Reverses route[i..j] (positions, wrapping around). The shorter of the
+// segment and its complement is reversed; both give the same tour.
+void reverse_segment(int *route, int *pos, int n, int i, int j)
+{
+    int len = (j - i + n) % n + 1;
+    if (2 * len > n)
+    {
+        const int t = i;
+        i = (j + 1) % n;
+        j = (t - 1 + n) % n;
+        len = n - len;
+    }
+    for (int k = 0; k < len / 2; k++)
+    {
+        const int a = route[i];
+        const int b = route[j];
+        route[i] = b;
+        pos[b] = i;
+        route[j] = a;
+        pos[a] = j;
+        i = (i + 1) % n;
+        j = (j - 1 + n) % n;
+    }
+}
+
+// 2-opt with neighbour lists and don't-look bits, starting from the cities
+// queued in ws. ws->pos must match route. Returns the total gain.
+double two_opt(City *city, int n, int *route, Workspace *ws, Neighbours *nb)
+{
+    double gain = 0.0;
+
+    while (ws->count > 0)
+    {
+        const int a = ws->queue[ws->head];
+        ws->head = (ws->head + 1) % n;
+        ws->count--;
+        ws->active[a] = 0;
+
+        int improved = 0;
+        for (int dir = 0; dir < 2 && !improved; dir++)
+        {
+            // dir 0: edges (a, succ a) and (c, succ c); dir 1: the predecessors
+            const int pa = ws->pos[a];
+            const int b = route[(dir == 0) ? (pa + 1) % n : (pa - 1 + n) % n];
+            const double d_ab = distance(city[a], city[b]);
+            const int *near = neighbours_of(nb, city, a);
+
+            for (int i = 0; i < nb->k; i++)
+            {
+                const int c = near[i];
+                const double d_ac = distance(city[a], city[c]);
+                if (d_ac >= d_ab)
+                    break;
+                const int pc = ws->pos[c];
+                const int d = route[(dir == 0) ? (pc + 1) % n : (pc - 1 + n) % n];
+                if (c == b || d == a)
+                    continue;
+
+                STATS_INC(counter[COUNT_MOVES]);
+                const double delta = d_ab + distance(city[c], city[d]) - d_ac - distance(city[b], city[d]);
+                if (delta > 1.0E-9)
+                {
+                    STATS_INC(counter[COUNT_IMPROVEMENTS]);
+                    if (dir == 0)
+                        reverse_segment(route, ws->pos, n, ws->pos[b], ws->pos[c]);
+                    else
+                        reverse_segment(route, ws->pos, n, ws->pos[a], ws->pos[d]);
+                    gain += delta;
+                    activate(ws, n, a);
+                    activate(ws, n, b);
+                    activate(ws, n, c);
+                    activate(ws, n, d);
+                    improved = 1;
+                    break;
+                }
+            }
+        }
+    }
+    return gain;
+}
+
+#define LK_DEPTH 25 // flips in one variable-depth move
+static const int lk_breadth[] = {5, 3}; // alternatives tried at the first two levels; 1 below
+
+// One Lin-Kernighan move in progress. t1 stays fixed and t2 = next(t1) is the
+// free end: each flip adds (t2, t3) for a near neighbour t3, removes (t4, t3)
+// with t4 = prev(t3), and reverses t2..t4 so that t4 becomes the new free end.
+// Closing the tour with (t4, t1) at any depth gives a valid tour.
+typedef struct
+{
+    City *city;
+    int n;
+    int *route;
+    Workspace *ws;
+    Neighbours *nb;
+    int t1;
+    int dir;                  // +1 if next(c) is route[pos[c] + 1], -1 if route[pos[c] - 1]
+    int depth;                // flips applied
+    int flip[LK_DEPTH][2];    // positions passed to reverse_segment
+    int flip_dir[LK_DEPTH];   // dir before each flip
+    int touched[LK_DEPTH][3]; // t2, t3, t4 of each flip; (t2, t3) is the added edge
+    double best_gain;
+    int best_depth;
+} Chain;
+
+static int lk_next(const Chain *ch, int c)
+{
+    return ch->route[(ch->ws->pos[c] + ch->dir + ch->n) % ch->n];
+}
+
+static int lk_prev(const Chain *ch, int c)
+{
+    return ch->route[(ch->ws->pos[c] - ch->dir + ch->n) % ch->n];
+}
+
+static void lk_flip(Chain *ch, int t2, int t3, int t4)
+{
+    const int *pos = ch->ws->pos;
+    int *f = ch->flip[ch->depth];
+    f[0] = (ch->dir > 0) ? pos[t2] : pos[t4];
+    f[1] = (ch->dir > 0) ? pos[t4] : pos[t2];
+    ch->flip_dir[ch->depth] = ch->dir;
+    ch->touched[ch->depth][0] = t2;
+    ch->touched[ch->depth][1] = t3;
+    ch->touched[ch->depth][2] = t4;
+    ch->depth++;
+    reverse_segment(ch->route, ch->ws->pos, ch->n, f[0], f[1]);
+    // reverse_segment may have reversed the complement instead, which turns
+    // the tour around
+    ch->dir = (ch->route[(pos[ch->t1] + 1) % ch->n] == t4) ? 1 : -1;
+}
+
+static void lk_undo(Chain *ch)
+{
+    ch->depth--;
+    reverse_segment(ch->route, ch->ws->pos, ch->n, ch->flip[ch->depth][0], ch->flip[ch->depth][1]);
+    ch->dir = ch->flip_dir[ch->depth];
+}
+
+// Extends the chain from the current free end; g is the gain so far with the
+// edge (t1, t2) removed. Returns with the flips applied once a closing gain is
+// found, undone otherwise.
+static void lk_step(Chain *ch, int level, double g)
+{
+    const int t2 = lk_next(ch, ch->t1);
+    const int breadth = (level < 2) ? lk_breadth[level] : 1;
+    int cand[breadth][2];
+    double value[breadth];
+    int found = 0;
+
+    const int *near = neighbours_of(ch->nb, ch->city, t2);
+    for (int i = 0; i < ch->nb->k; i++)
+    {
+        const int t3 = near[i];
+        const double g1 = g - distance(ch->city[t2], ch->city[t3]);
+        if (g1 <= 1.0E-9) // gain criterion; the list is sorted, so no later t3 passes
+            break;
+        if (t3 == ch->t1 || t3 == lk_next(ch, t2))
+            continue;
+        const int t4 = lk_prev(ch, t3);
+        int tabu = 0; // never remove an edge added earlier in the chain
+        for (int k = 0; k < ch->depth && !tabu; k++)
+            tabu = (ch->touched[k][0] == t3 && ch->touched[k][1] == t4) ||
+                   (ch->touched[k][0] == t4 && ch->touched[k][1] == t3);
+        if (tabu)
+            continue;
+
+        STATS_INC(counter[COUNT_MOVES]);
+        const double v = g1 + distance(ch->city[t3], ch->city[t4]);
+        int j;
+        if (found < breadth)
+            j = found++;
+        else if (v > value[breadth - 1])
+            j = breadth - 1;
+        else
+            continue;
+        while (j > 0 && value[j - 1] < v)
+        {
+            value[j] = value[j - 1];
+            cand[j][0] = cand[j - 1][0];
+            cand[j][1] = cand[j - 1][1];
+            j--;
+        }
+        value[j] = v;
+        cand[j][0] = t3;
+        cand[j][1] = t4;
+    }
+
+    for (int i = 0; i < found; i++)
+    {
+        const int t3 = cand[i][0], t4 = cand[i][1];
+        lk_flip(ch, t2, t3, t4);
+        const double closed = value[i] - distance(ch->city[t4], ch->city[ch->t1]);
+        if (closed > ch->best_gain)
+        {
+            ch->best_gain = closed;
+            ch->best_depth = ch->depth;
+        }
+        if (ch->depth < LK_DEPTH)
+            lk_step(ch, level + 1, value[i]);
+        if (ch->best_gain > 1.0E-9)
+            return;
+        lk_undo(ch);
+    }
+}
+
+// Lin-Kernighan style variable-depth search built from chained 2-opt flips,
+// with neighbour lists and don't-look bits like two_opt. Each move is cut back
+// to the depth with the best closing gain. ws->pos must match route. Returns
+// the total gain.
+double lin_kernighan(City *city, int n, int *route, Workspace *ws, Neighbours *nb)
+{
+    double gain = 0.0;
+
+    while (ws->count > 0)
+    {
+        const int a = ws->queue[ws->head];
+        ws->head = (ws->head + 1) % n;
+        ws->count--;
+        ws->active[a] = 0;
+
+        for (int dir = 1; dir >= -1; dir -= 2)
+        {
+            Chain ch = {.city = city, .n = n, .route = route, .ws = ws, .nb = nb, .t1 = a, .dir = dir,
+                        .depth = 0, .best_gain = 0.0, .best_depth = 0};
+            const int t2 = lk_next(&ch, a);
+            lk_step(&ch, 0, distance(city[a], city[t2]));
+            if (ch.best_gain <= 1.0E-9)
+                continue;
+
+            while (ch.depth > ch.best_depth)
+                lk_undo(&ch);
+            STATS_INC(counter[COUNT_IMPROVEMENTS]);
+            gain += ch.best_gain;
+            activate(ws, n, a);
+            for (int k = 0; k < ch.depth; k++)
+                for (int e = 0; e < 3; e++)
+                    activate(ws, n, ch.touched[k][e]);
+            break;
+        }
+    }
+    return gain;
+}
+
+// Previous tours are stored by coordinates so that they stay meaningful when
+// cities are added to or removed from the city file: a count, then one "x y"
+// line per city in tour order.
+void save_tour(const char *filename, City *city, const int *route, int n)
+{
+    FILE *fp;
+    if ((fp = fopen(filename, "w")) == NULL)
+    {
+        fprintf(stderr, "%s: cannot open file.\n", filename);
+        exit(1);
+    }
+    fprintf(fp, "%d\n", n);
+    for (int i = 0; i < n; i++)
+        fprintf(fp, "%d %d\n", city[route[i]].x, city[route[i]].y);
+    fclose(fp);
+}
+
+City *load_tour(const char *filename, int *n)
+{
+    FILE *fp;
+    if ((fp = fopen(filename, "r")) == NULL)
+    {
+        fprintf(stderr, "%s: cannot open file.\n", filename);
+        exit(1);
+    }
+    if (fscanf(fp, "%d", n) != 1 || *n < 0)
+    {
+        fprintf(stderr, "%s: invalid tour file.\n", filename);
+        exit(1);
+    }
+    City *tour = (City *)malloc(sizeof(City) * (*n > 0 ? *n : 1));
+    for (int i = 0; i < *n; i++)
+    {
+        if (fscanf(fp, "%d %d", &tour[i].x, &tour[i].y) != 2)
+        {
+            fprintf(stderr, "%s: invalid tour file.\n", filename);
+            exit(1);
+        }
+    }
+    fclose(fp);
+    return tour;
+}
+
+static const City *sort_city;
+
+static int compare_city_index(const void *p, const void *q)
+{
+    const City a = sort_city[*(const int *)p];
+    const City b = sort_city[*(const int *)q];
+    if (a.x != b.x)
+        return (a.x < b.x) ? -1 : 1;
+    return (a.y > b.y) - (a.y < b.y);
+}
+
+// Nearest city to order[r] among those in the ring, found by walking the
+// cities sorted by x outwards until the x gap alone exceeds the best distance.
+static int nearest_in_ring(City *city, int n, const int *order, int r, const int *succ)
+{
+    const City a = city[order[r]];
+    int best = -1;
+    double d = 1.0E300;
+    for (int i = r - 1; i >= 0 && a.x - city[order[i]].x <= d; i--)
+        if (succ[order[i]] >= 0 && distance(a, city[order[i]]) < d)
+        {
+            d = distance(a, city[order[i]]);
+            best = order[i];
+        }
+    for (int i = r + 1; i < n && city[order[i]].x - a.x <= d; i++)
+        if (succ[order[i]] >= 0 && distance(a, city[order[i]]) < d)
+        {
+            d = distance(a, city[order[i]]);
+            best = order[i];
+        }
+    return best;
+}
+
+// Rebuilds the previous tour on the current cities: tour cities that no longer
+// exist are spliced out, new cities are added by cheapest insertion, and 2-opt
+// (or Lin-Kernighan) then runs from the cities next to those changes only.
+// The tour is kept as a ring while cities are inserted, and the cities sorted
+// by (x, y), which match the tour to the cities, also serve the neighbour
+// searches. Loading, that sort and laying the ring out for the local search
+// remain linear in n or above.
+Answer warm_start(City *city, int n, const City *prev, int n_prev, LocalSearch search, Workspace *ws)
+{
+    STATS_TIMER_BEGIN(t_construct);
+    reserve_workspace(ws, n);
+    int *route = ws->best;
+    int *pos = ws->pos;
+    int *order = ws->trial;
+    int *succ = ws->succ;
+    int *pred = ws->pred;
+    ws->head = 0;
+    ws->count = 0;
+    memset(ws->active, 0, n);
+
+    // match tour coordinates to city indices through the cities sorted by (x, y)
+    for (int i = 0; i < n; i++)
+    {
+        order[i] = i;
+        succ[i] = -1;
+    }
+    sort_city = city;
+    qsort(order, n, sizeof(int), compare_city_index);
+    for (int i = 0; i < n; i++)
+        ws->rank[order[i]] = i;
+
+    int len = 0;
+    int first = -1;  // where the ring is laid out from
+    int last = -1;
+    int spliced = 0; // a removed city sits just before the next kept one
+    for (int i = 0; i < n_prev; i++)
+    {
+        int lo = 0, hi = n;
+        while (lo < hi)
+        {
+            const int mid = (lo + hi) / 2;
+            const City c = city[order[mid]];
+            if (c.x < prev[i].x || (c.x == prev[i].x && c.y < prev[i].y))
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        while (lo < n && city[order[lo]].x == prev[i].x && city[order[lo]].y == prev[i].y && succ[order[lo]] >= 0)
+            lo++;
+        if (lo == n || city[order[lo]].x != prev[i].x || city[order[lo]].y != prev[i].y)
+        {
+            STATS_INC(counter[COUNT_REMOVED]);
+            if (len > 0)
+                activate(ws, n, last);
+            spliced = 1;
+            continue;
+        }
+        const int c = order[lo];
+        if (len == 0)
+            first = c;
+        else
+        {
+            succ[last] = c;
+            pred[c] = last;
+        }
+        succ[c] = first; // closes the ring until the next city comes
+        pred[first] = c;
+        last = c;
+        len++;
+        if (spliced)
+        {
+            activate(ws, n, c);
+            spliced = 0;
+        }
+    }
+    if (spliced && len > 0)
+        activate(ws, n, first);
+
+    Neighbours nb;
+    init_neighbours(&nb, ws, n);
+    nb.order = order;
+    nb.rank = ws->rank;
+
+    for (int c = 0; c < n; c++)
+    {
+        if (succ[c] >= 0)
+            continue;
+        STATS_INC(counter[COUNT_INSERTED]);
+        if (len == 0)
+        {
+            first = c;
+            succ[c] = pred[c] = c;
+            len++;
+            activate(ws, n, c);
+            continue;
+        }
+
+        // try the edges next to c's nearest tour cities, or next to the
+        // nearest tour city if none of its neighbours is in the tour yet
+        int at = -1;
+        double best = 1.0E300;
+        const int *near = neighbours_of(&nb, city, c);
+        int in_ring = 0;
+        for (int i = 0; i <= nb.k; i++)
+        {
+            int p;
+            if (i < nb.k)
+                p = near[i];
+            else if (in_ring == 0)
+                p = nearest_in_ring(city, n, order, ws->rank[c], succ);
+            else
+                break;
+            if (succ[p] < 0)
+                continue;
+            in_ring++;
+            for (int e = 0; e < 2; e++)
             {
-                ans->distance = distance;
-                copy_list(ans->route, route, n);
+                const int u = e ? p : pred[p];
+                const int v = succ[u];
+                const double cost = distance(city[u], city[c]) + distance(city[c], city[v]) - distance(city[u], city[v]);
+                if (cost < best)
+                {
+                    best = cost;
+                    at = u;
+                }
             }
         }
 
-    return *ans;
-}
\ No newline at end of file
+        const int v = succ[at];
+        succ[at] = c;
+        pred[c] = at;
+        succ[c] = v;
+        pred[v] = c;
+        len++;
+        activate(ws, n, at);
+        activate(ws, n, c);
+        activate(ws, n, v);
+    }
+
+    // the local search works on a route array with positions
+    for (int i = 0, c = first; i < n; i++, c = succ[c])
+    {
+        route[i] = c;
+        pos[c] = i;
+    }
+    STATS_TIMER_END(t_construct, phase[PHASE_CONSTRUCT]);
+
+    STATS_TIMER_BEGIN(t_search);
+    if (search == SEARCH_LK)
+        lin_kernighan(city, n, route, ws, &nb);
+    else
+        two_opt(city, n, route, ws, &nb);
+    STATS_TIMER_END(t_search, phase[PHASE_LOCAL_SEARCH]);
+
+    rotate_to_zero(route, n, ws->trial);
+    return (Answer){.route = route, .distance = total_distance(city, route, n)};
+}
+
+// Nearest city to current among the n_left cities of ws->left, by a scan.
+static int nearest_left(City *city, Workspace *ws, int n_left, int current)
+{
+    int next = -1;
+    double best = 1.0E300;
+    for (int i = 0; i < n_left; i++)
+    {
+        const double d = distance(city[current], city[ws->left[i]]);
+        if (d < best)
+        {
+            best = d;
+            next = ws->left[i];
+        }
+    }
+    return next;
+}
+
+// Nearest neighbour tour from a random first city. The next city is taken from
+// the neighbour lists, or by a scan of the cities left when all the listed
+// ones are already in the tour.
+void nearest_neighbour_route(City *city, int n, int *route, Workspace *ws, Neighbours *nb, unsigned int *seed)
+{
+    for (int i = 0; i < n; i++)
+    {
+        ws->left[i] = i;
+        ws->left_pos[i] = i;
+    }
+    int n_left = n;
+
+    int current = rand_r(seed) % n;
+    for (int k = 0; k < n; k++)
+    {
+        route[k] = current;
+        const int last = ws->left[--n_left];
+        ws->left[ws->left_pos[current]] = last;
+        ws->left_pos[last] = ws->left_pos[current];
+        ws->left_pos[current] = -1;
+        if (n_left == 0)
+            break;
+
+        int next = -1;
+        const int *near = neighbours_of(nb, city, current);
+        for (int i = 0; i < nb->k && next < 0; i++)
+            if (ws->left_pos[near[i]] >= 0)
+                next = near[i];
+        if (next < 0)
+            next = nearest_left(city, ws, n_left, current);
+        current = next;
+    }
+}
+
+// Runs 2-opt or Lin-Kernighan over the whole route and returns its length.
+double optimise_route(City *city, int n, int *route, LocalSearch search, Workspace *ws, Neighbours *nb)
+{
+    ws->head = 0;
+    ws->count = 0;
+    memset(ws->active, 0, n);
+    for (int i = 0; i < n; i++)
+    {
+        ws->pos[route[i]] = i;
+        activate(ws, n, route[i]);
+    }
+    if (search == SEARCH_LK)
+        lin_kernighan(city, n, route, ws, nb);
+    else
+        two_opt(city, n, route, ws, nb);
+    return total_distance(city, route, n);
+}
+
+static void add_edge(Workspace *ws, int a, int b)
+{
+    int *adj = ws->adj + 4 * a;
+    for (int i = 0; i < ws->deg[a]; i++)
+    {
+        if (adj[i] == b)
+        {
+            ws->common[4 * a + i] = 1;
+            return;
+        }
+    }
+    ws->common[4 * a + ws->deg[a]] = 0;
+    adj[ws->deg[a]++] = b;
+}
+
+static void remove_edge(Workspace *ws, int a, int b)
+{
+    int *adj = ws->adj + 4 * a;
+    for (int i = 0; i < ws->deg[a]; i++)
+    {
+        if (adj[i] == b)
+        {
+            const int last = --ws->deg[a];
+            adj[i] = adj[last];
+            ws->common[4 * a + i] = ws->common[4 * a + last];
+            return;
+        }
+    }
+}
+
+// Edge recombination crossover: the child follows edges of either parent,
+// preferring edges both share and then the neighbour with the fewest edges
+// left. When it gets stuck it jumps to the nearest unvisited city, from the
+// neighbour lists or else by a scan; random jumps left long edges that 2-opt
+// did not repair.
+void edge_recombination(City *city, int n, const int *p1, const int *p2, int *child, Workspace *ws,
+                        Neighbours *nb, unsigned int *seed)
+{
+    memset(ws->deg, 0, n);
+    for (int i = 0; i < n; i++)
+    {
+        const int a1 = p1[i], b1 = p1[(i + 1) % n];
+        const int a2 = p2[i], b2 = p2[(i + 1) % n];
+        add_edge(ws, a1, b1);
+        add_edge(ws, b1, a1);
+        add_edge(ws, a2, b2);
+        add_edge(ws, b2, a2);
+    }
+    for (int i = 0; i < n; i++)
+    {
+        ws->left[i] = i;
+        ws->left_pos[i] = i;
+    }
+    int n_left = n;
+
+    int current = 0;
+    for (int k = 0; k < n; k++)
+    {
+        child[k] = current;
+        const int last = ws->left[--n_left];
+        ws->left[ws->left_pos[current]] = last;
+        ws->left_pos[last] = ws->left_pos[current];
+        ws->left_pos[current] = -1;
+        for (int i = 0; i < ws->deg[current]; i++)
+            remove_edge(ws, ws->adj[4 * current + i], current);
+        if (n_left == 0)
+            break;
+
+        int next = -1;
+        int best_deg = 5;
+        int ties = 0;
+        for (int i = 0; i < ws->deg[current]; i++)
+        {
+            const int c = ws->adj[4 * current + i];
+            if (ws->common[4 * current + i])
+            {
+                next = c;
+                break;
+            }
+            if (ws->deg[c] < best_deg)
+            {
+                best_deg = ws->deg[c];
+                next = c;
+                ties = 1;
+            }
+            else if (ws->deg[c] == best_deg && rand_r(seed) % ++ties == 0)
+                next = c;
+        }
+        if (next < 0)
+        {
+            const int *near = neighbours_of(nb, city, current);
+            for (int i = 0; i < nb->k && next < 0; i++)
+                if (ws->left_pos[near[i]] >= 0)
+                    next = near[i];
+        }
+        if (next < 0)
+            next = nearest_left(city, ws, n_left, current);
+        current = next;
+    }
+}
+
+// Breeds the worker's share of one generation: nearest neighbour tours in
+// generation 0, as solve() starts, and edge recombination children after.
+static void breed(Population *pop, int id, Workspace *ws)
+{
+    const int n = pop->n;
+
+    for (int i = id; i < pop->size; i += pop->threads)
+    {
+        // seeded per slot and generation, so the result does not depend on the thread count
+        unsigned int seed = pop->seed + 7919u * (unsigned int)pop->generation + 104729u * (unsigned int)i;
+        int *child = pop->child + (size_t)i * n;
+
+        STATS_TIMER_BEGIN(t_construct);
+        if (pop->generation == 0)
+            nearest_neighbour_route(pop->city, n, child, ws, pop->nb, &seed);
+        else
+        {
+            // binary tournaments for both parents
+            int p[2];
+            for (int k = 0; k < 2; k++)
+            {
+                const int a = rand_r(&seed) % pop->size;
+                const int b = rand_r(&seed) % pop->size;
+                p[k] = (pop->length[a] <= pop->length[b]) ? a : b;
+            }
+            edge_recombination(pop->city, n, pop->tour + (size_t)p[0] * n, pop->tour + (size_t)p[1] * n,
+                               child, ws, pop->nb, &seed);
+        }
+        STATS_TIMER_END(t_construct, phase[PHASE_CONSTRUCT]);
+
+        STATS_TIMER_BEGIN(t_search);
+        pop->child_length[i] = optimise_route(pop->city, n, child, pop->search, ws, pop->nb);
+        STATS_TIMER_END(t_search, phase[PHASE_LOCAL_SEARCH]);
+        STATS_INC(counter[COUNT_OFFSPRING]);
+    }
+}
+
+void *genetic_worker(void *arg)
+{
+    GeneticWorker *worker = (GeneticWorker *)arg;
+    Population *pop = worker->pop;
+
+    for (;;)
+    {
+        pthread_barrier_wait(&pop->start);
+        if (pop->generation < 0)
+            break;
+        breed(pop, worker->id, &pop->ws[worker->id]);
+        pthread_barrier_wait(&pop->done);
+    }
+
+    pthread_mutex_lock(&pop->lock);
+    stats_merge(pop->phase, phase, N_PHASE, pop->counter, counter, N_COUNTER);
+    pthread_mutex_unlock(&pop->lock);
+    return NULL;
+}
+
+typedef struct
+{
+    double length;
+    int index; // < size: parent, otherwise child index + size
+} Ranked;
+
+static int compare_ranked(const void *p, const void *q)
+{
+    const Ranked *a = (const Ranked *)p;
+    const Ranked *b = (const Ranked *)q;
+    if (a->length != b->length)
+        return (a->length < b->length) ? -1 : 1;
+    return a->index - b->index;
+}
+
+// Memetic search: a population of locally optimised tours is bred with edge
+// recombination; every generation the best distinct tours of parents and
+// offspring survive. The returned route is ws->best.
+Answer genetic(City *city, int n, int size, int generations, int threads, unsigned int seed,
+               LocalSearch search, Workspace *ws, Progress *progress)
+{
+    reserve_workspace(ws, n);
+
+    // neighbour lists are shared by the workers, so fill them all up front
+    Neighbours nb;
+    init_neighbours(&nb, ws, n);
+    for (int c = 0; c < n; c++)
+        neighbours_of(&nb, city, c);
+
+    Population pop = {.city = city, .n = n, .size = size, .generation = 0, .threads = threads, .seed = seed,
+                      .nb = &nb, .search = search, .phase = phase, .counter = counter};
+    pop.tour = (int *)malloc(sizeof(int) * n * size);
+    pop.child = (int *)malloc(sizeof(int) * n * size);
+    pop.length = (double *)malloc(sizeof(double) * size);
+    pop.child_length = (double *)malloc(sizeof(double) * size);
+    pop.ws = (Workspace *)malloc(sizeof(Workspace) * threads);
+    for (int t = 0; t < threads; t++)
+    {
+        init_workspace(&pop.ws[t]);
+        reserve_workspace(&pop.ws[t], n);
+    }
+    pthread_mutex_init(&pop.lock, NULL);
+    pthread_barrier_init(&pop.start, NULL, threads + 1);
+    pthread_barrier_init(&pop.done, NULL, threads + 1);
+
+    int *next = (int *)malloc(sizeof(int) * n * size);
+    double next_length[size];
+    Ranked rank[2 * size];
+    GeneticWorker worker[threads];
+    pthread_t tid[threads];
+    Answer ans = {.route = ws->best, .distance = 1.0E300};
+
+    for (int t = 0; t < threads; t++)
+    {
+        worker[t] = (GeneticWorker){.pop = &pop, .id = t};
+        pthread_create(&tid[t], NULL, genetic_worker, &worker[t]);
+    }
+
+    for (int g = 0; g <= generations; g++)
+    {
+        pop.generation = g;
+        pthread_barrier_wait(&pop.start);
+        pthread_barrier_wait(&pop.done);
+        STATS_INC(counter[COUNT_GENERATIONS]);
+
+        // survivors: best distinct tours among parents and offspring
+        int m = 0;
+        if (g > 0)
+            for (int i = 0; i < size; i++)
+                rank[m++] = (Ranked){.length = pop.length[i], .index = i};
+        for (int i = 0; i < size; i++)
+            rank[m++] = (Ranked){.length = pop.child_length[i], .index = size + i};
+        qsort(rank, m, sizeof(Ranked), compare_ranked);
+
+        int kept = 0;
+        for (int pass = 0; pass < 2 && kept < size; pass++)
+        {
+            for (int i = 0; i < m && kept < size; i++)
+            {
+                const int distinct = (i == 0 || rank[i].length - rank[i - 1].length > 1.0E-7);
+                if (rank[i].index < 0 || (pass == 0 && !distinct))
+                    continue;
+                const int *src = (rank[i].index < size) ? pop.tour + (size_t)rank[i].index * n
+                                                        : pop.child + (size_t)(rank[i].index - size) * n;
+                memcpy(next + (size_t)kept * n, src, sizeof(int) * n);
+                next_length[kept++] = rank[i].length;
+                rank[i].index = -1;
+            }
+        }
+        int *t = pop.tour;
+        pop.tour = next;
+        next = t;
+        memcpy(pop.length, next_length, sizeof(double) * size);
+
+        if (pop.length[0] < ans.distance - 1.0E-9)
+        {
+            ans.distance = pop.length[0];
+            copy_list(ans.route, pop.tour, n);
+            if (progress != NULL)
+            {
+                STATS_TIMER_BEGIN(t_plot);
+                plot_cities_update(progress, city, n, ans.route);
+                STATS_TIMER_END(t_plot, phase[PHASE_OUTPUT]);
+            }
+        }
+    }
+
+    pop.generation = -1;
+    pthread_barrier_wait(&pop.start);
+    for (int t = 0; t < threads; t++)
+        pthread_join(tid[t], NULL);
+
+    rotate_to_zero(ans.route, n, ws->trial);
+
+    pthread_barrier_destroy(&pop.start);
+    pthread_barrier_destroy(&pop.done);
+    pthread_mutex_destroy(&pop.lock);
+    for (int t = 0; t < threads; t++)
+        free_workspace(&pop.ws[t]);
+    free(pop.ws);
+    free(pop.tour);
+    free(pop.child);
+    free(pop.length);
+    free(pop.child_length);
+    free(next);
+    return ans;
+}
@@ -1,50 +1,330 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "stats.h"
+#include "fileio.h"
+
+// Converts a text item or city file (the count, then 2n numbers separated by
+// white space) to the binary format. The text is mapped into memory and cut
+// into one chunk per thread at white space; each thread parses its chunk on
+// its own and the chunks are written out in order.
+
+typedef struct
+{
+    const char *begin; // chunk of the text, starting and ending at white space
+    const char *end;
+    int cities;        // parse ints instead of doubles
+    void *value;
+    size_t count;
+    size_t capacity;
+    size_t fallbacks;  // numbers handed to strtod
+    const char *error; // first token that is not a number, or NULL
+} Chunk;
+
+enum { PHASE_PARSE, PHASE_WRITE, N_PHASE };
+enum { COUNT_VALUES, COUNT_FALLBACKS, COUNT_BYTES, N_COUNTER };
+
+StatsPhase phase[N_PHASE] = {
+    [PHASE_PARSE] = {"parse"},
+    [PHASE_WRITE] = {"write"},
+};
+StatsCounter counter[N_COUNTER] = {
+    [COUNT_VALUES] = {"values"},
+    [COUNT_FALLBACKS] = {"fallbacks"},
+    [COUNT_BYTES] = {"bytes"},
+};
+
+static int is_space(char c)
+{
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+static int is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static const double power_of_ten[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+// strtod on a token that is not NUL-terminated.
+static int parse_double_slow(const char *p, const char *end, double *out)
+{
+    char buffer[128];
+    const size_t length = end - p;
+    char *token = (length < sizeof(buffer)) ? buffer : (char *)malloc(length + 1);
+    memcpy(token, p, length);
+    token[length] = '\0';
+    char *e;
+    *out = strtod(token, &e);
+    const int ok = (length > 0 && *e == '\0');
+    if (token != buffer)
+        free(token);
+    return ok;
+}
+
+// Parses the decimal number in [p, end). When the significand fits in 53 bits
+// and the power of ten is at most 10^22, both are exact doubles and one
+// multiplication or division rounds correctly (Clinger's fast path). Anything
+// else, including inf, nan and hex floats, goes to strtod. Returns 0 if the
+// token is not a number, 2 if it needed strtod.
+static int parse_double(const char *p, const char *end, double *out)
+{
+    const char *start = p;
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = (*p++ == '-');
+    uint64_t significand = 0;
+    int digits = 0;   // significant digits kept in significand
+    int exponent = 0;
+    int any = 0;
+    int exact = 1;
+    for (; p < end && is_digit(*p); p++, any = 1)
+    {
+        if (digits < 19)
+        {
+            significand = significand * 10 + (*p - '0');
+            digits += (significand > 0);
+        }
+        else
+        {
+            exponent++;
+            exact &= (*p == '0');
+        }
+    }
+    if (p < end && *p == '.')
+    {
+        for (p++; p < end && is_digit(*p); p++, any = 1)
+        {
+            if (digits < 19)
+            {
+                significand = significand * 10 + (*p - '0');
+                digits += (significand > 0);
+                exponent--;
+            }
+            else
+                exact &= (*p == '0');
+        }
+    }
+    if (any && p < end && (*p == 'e' || *p == 'E'))
+    {
+        p++;
+        int sign = 1, e = 0;
+        if (p < end && (*p == '-' || *p == '+'))
+            sign = (*p++ == '-') ? -1 : 1;
+        if (p == end || !is_digit(*p))
+            return parse_double_slow(start, end, out) ? 2 : 0;
+        for (; p < end && is_digit(*p); p++)
+            if (e < 100000)
+                e = e * 10 + (*p - '0');
+        exponent += sign * e;
+    }
+    if (!any || p != end || !exact || significand > (1ULL << 53) || exponent < -22 || exponent > 22)
+        return parse_double_slow(start, end, out) ? 2 : 0;
+
+    double d = (double)significand;
+    d = (exponent < 0) ? d / power_of_ten[-exponent] : d * power_of_ten[exponent];
+    *out = negative ? -d : d;
+    return 1;
+}
+
+static int parse_int(const char *p, const char *end, int *out)
+{
+    int negative = 0;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = (*p++ == '-');
+    if (p == end)
+        return 0;
+    long long v = 0;
+    for (; p < end; p++)
+    {
+        if (!is_digit(*p))
+            return 0;
+        v = v * 10 + (*p - '0');
+        if (v > (long long)INT_MAX + negative)
+            return 0;
+    }
+    *out = (int)(negative ? -v : v);
+    return 1;
+}
+
+static void *parse_chunk(void *arg)
+{
+    Chunk *chunk = (Chunk *)arg;
+    const size_t size = chunk->cities ? sizeof(int) : sizeof(double);
+    const char *p = chunk->begin;
+    for (;;)
+    {
+        while (p < chunk->end && is_space(*p))
+            p++;
+        if (p == chunk->end)
+            break;
+        const char *q = p;
+        while (q < chunk->end && !is_space(*q))
+            q++;
+        if (chunk->count == chunk->capacity)
+        {
+            chunk->capacity = (chunk->capacity > 0) ? 2 * chunk->capacity : 4096;
+            chunk->value = realloc(chunk->value, size * chunk->capacity);
+        }
+        int ok;
+        if (chunk->cities)
+            ok = parse_int(p, q, (int *)chunk->value + chunk->count);
+        else
+            ok = parse_double(p, q, (double *)chunk->value + chunk->count);
+        if (!ok)
+        {
+            chunk->error = p;
+            break;
+        }
+        chunk->fallbacks += (ok == 2);
+        chunk->count++;
+        p = q;
+    }
+    return NULL;
+}
+
+static void report_token(const char *filename, const char *p, const char *end)
+{
+    const char *q = p;
+    while (q < end && !is_space(*q) && q - p < 40)
+        q++;
+    fprintf(stderr, "%s: '%.*s' is not a number.\n", filename, (int)(q - p), p);
+    exit(1);
+}
 
 int main(int argc, char **argv)
 {
-    if (argc != 3)
+    char *args[argc];
+    int nargs = 0;
+    int cities = 0;
+    int show_stats = 0;
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < argc; i++)
     {
-        fprintf(stderr, "usage: %s <txt filename> <binary filename>\n", argv[1]);
+        if (strcmp(argv[i], "--cities") == 0)
+            cities = 1;
+        else if (strncmp(argv[i], "--threads=", 10) == 0)
+            threads = atoi(argv[i] + 10);
+        else if (strcmp(argv[i], "--stats=json") == 0)
+            show_stats = 1;
+        else if (strncmp(argv[i], "--", 2) == 0)
+        {
+            fprintf(stderr, "%s: unknown option.\n", argv[i]);
+            exit(1);
+        }
+        else
+            args[nargs++] = argv[i];
+    }
+    if (nargs != 2)
+    {
+        fprintf(stderr, "usage: %s [--cities] [--threads=N] [--stats=json] <txt filename> <binary filename>\n", argv[0]);
         return EXIT_FAILURE;
     }
-    size_t size = 10;
-    double *d = (double *)malloc(sizeof(double) * size);
-    double *f = (double *)malloc(sizeof(double) * size);
-
-    srand(100);
-    for (int i = 0; i < size; i++)
-        d[i] = 0.5423 * (rand()%100);
-    for (int i = 0; i < size; i++)
-        f[i] = 0.1234 * (rand()%100);
+    if (threads < 1)
+        threads = 1;
+    const char *input = args[0];
+    const char *output = args[1];
 
+    STATS_TIMER_BEGIN(t_parse);
     FILE *fp;
-    if ((fp = fopen(argv[1], "w")) == NULL)
+    if ((fp = fopen(input, "r")) == NULL)
     {
-        fprintf(stderr, "%s: cannot open file.\n", argv[1]);
+        fprintf(stderr, "%s: cannot open file.\n", input);
         return EXIT_FAILURE;
     }
-
-    fprintf(fp, "%zu\n", size);
-    for (int i = 0; i < size; i++)
+    struct stat st;
+    if (fstat(fileno(fp), &st) != 0 || st.st_size == 0)
     {
-        fprintf(fp, "%f\n", d[i]);
-        fprintf(fp, "%f\n", f[i]);
+        fprintf(stderr, "%s: empty file.\n", input);
+        return EXIT_FAILURE;
     }
+    const size_t length = st.st_size;
+    const char *text = (const char *)mmap(NULL, length, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (text == MAP_FAILED)
+    {
+        fprintf(stderr, "%s: cannot map file.\n", input);
+        return EXIT_FAILURE;
+    }
+    madvise((void *)text, length, MADV_SEQUENTIAL);
     fclose(fp);
+    const char *end = text + length;
+    STATS_ADD(counter[COUNT_BYTES], length);
+
+    // the count, then the body
+    const char *p = text;
+    while (p < end && is_space(*p))
+        p++;
+    const char *q = p;
+    while (q < end && !is_space(*q))
+        q++;
+    int n;
+    if (!parse_int(p, q, &n) || n < 0)
+        report_token(input, p, end);
 
-    if ((fp = fopen(argv[2], "wb")) == NULL)
+    // at least 1 MiB of text per thread
+    const size_t body = end - q;
+    if ((size_t)threads > body / (1 << 20) + 1)
+        threads = (int)(body / (1 << 20) + 1);
+    Chunk chunk[threads];
+    pthread_t tid[threads];
+    const char *begin = q;
+    for (int i = 0; i < threads; i++)
     {
-        fprintf(stderr, "%s: cannot open file.\n", argv[1]);
+        const char *stop = (i == threads - 1) ? end : q + body / threads * (i + 1);
+        if (stop < begin)
+            stop = begin;
+        while (stop < end && !is_space(*stop))
+            stop++;
+        chunk[i] = (Chunk){.begin = begin, .end = stop, .cities = cities, .value = NULL,
+                           .count = 0, .capacity = 0, .fallbacks = 0, .error = NULL};
+        begin = stop;
+    }
+    for (int i = 1; i < threads; i++)
+        pthread_create(&tid[i], NULL, parse_chunk, &chunk[i]);
+    parse_chunk(&chunk[0]);
+    for (int i = 1; i < threads; i++)
+        pthread_join(tid[i], NULL);
+
+    size_t total = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        if (chunk[i].error != NULL)
+            report_token(input, chunk[i].error, end);
+        total += chunk[i].count;
+        STATS_ADD(counter[COUNT_FALLBACKS], chunk[i].fallbacks);
+    }
+    STATS_ADD(counter[COUNT_VALUES], total);
+    if (total != 2 * (size_t)n)
+    {
+        fprintf(stderr, "%s: %d %s need %zu numbers, found %zu.\n", input, n, cities ? "cities" : "items",
+                2 * (size_t)n, total);
+        for (int i = 0; i < threads; i++)
+            free(chunk[i].value);
         return EXIT_FAILURE;
     }
+    munmap((void *)text, length);
+    STATS_TIMER_END(t_parse, phase[PHASE_PARSE]);
 
-    fwrite(&size, sizeof(int), 1, fp);
-    for (int i = 0; i < size; i++)
+    STATS_TIMER_BEGIN(t_write);
+    const size_t size = cities ? sizeof(int) : sizeof(double);
+    BlockWriter *w = open_writer(output);
+    write_count(w, n);
+    for (int i = 0; i < threads; i++)
     {
-        fwrite(&d[i], sizeof(double), 1, fp);
-        fwrite(&f[i], sizeof(double), 1, fp);
+        write_bytes(w, chunk[i].value, size * chunk[i].count);
+        free(chunk[i].value);
     }
-    fclose(fp);
+    close_writer(w);
+    STATS_TIMER_END(t_write, phase[PHASE_WRITE]);
+
+    if (show_stats)
+        stats_print_json(stderr, "write_binary", phase, N_PHASE, counter, N_COUNTER);
     return EXIT_SUCCESS;
 }